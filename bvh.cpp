@@ -0,0 +1,310 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <sstream>
+
+// The cost of visiting an interior node, relative to intersecting one shape.
+const float BVH_TRAVERSAL_COST = 0.125;
+
+inline float surfaceArea(const Vec3& low_corner, const Vec3& high_corner){
+    Vec3 dims = high_corner - low_corner;
+    return 2 * (dims.x * dims.y + dims.y * dims.z + dims.z * dims.x);
+}
+
+// Grow the box given by the first two vectors to include the box given by the last two.
+inline void growBounds(Vec3& low_corner, Vec3& high_corner, const Vec3& low, const Vec3& high){
+    for (int i = 0; i < 3; ++i){
+        low_corner[i] = min(low_corner[i], low[i]);
+        high_corner[i] = max(high_corner[i], high[i]);
+    }
+}
+
+// Which of the BVH_BUCKETS buckets the given centroid falls into along the given axis.
+inline int bucketIndex(const BVHBuildShape& s, const int axis, const float low_bound, const float inv_width){
+    int bucket = (int) ((s.centroid[axis] - low_bound) * inv_width);
+    return min(max(bucket, 0), BVH_BUCKETS - 1);
+}
+
+// Used to partition shapes by which side of the chosen bucket boundary their centroid is on.
+struct BVHBucketBelow{
+    BVHBucketBelow(const int axis, const float low_bound, const float inv_width, const int bucket) : axis(axis),
+                                                                                                     low_bound(low_bound),
+                                                                                                     inv_width(inv_width),
+                                                                                                     bucket(bucket) {}
+
+    bool operator()(const BVHBuildShape& s) const{
+        return bucketIndex(s, axis, low_bound, inv_width) <= bucket;
+    }
+
+    int axis;
+    float low_bound, inv_width;
+    int bucket;
+};
+
+BVH::BVH(const vector<Shape*>& s){
+    if (s.empty()){
+        return;
+    }
+
+    vector<BVHBuildShape> build_shapes(s.size());
+    for (unsigned int i = 0; i < s.size(); ++i){
+        for (int a = 0; a < 3; ++a){
+            // Padded the same way as the kd-tree's bounds, so hits on the faces of the boxes
+            // aren't lost to rounding.
+            build_shapes[i].low_corner[a] = s[i]->extremeValue(a, EXTREME_VALUE_SMALLEST) - EPSILON;
+            build_shapes[i].high_corner[a] = s[i]->extremeValue(a, EXTREME_VALUE_LARGEST) + EPSILON;
+        }
+        build_shapes[i].centroid = (build_shapes[i].low_corner + build_shapes[i].high_corner) * 0.5;
+        build_shapes[i].shape = s[i];
+    }
+
+    // A binary tree with at least one shape per leaf never needs more nodes than this.
+    nodes.reserve(2 * s.size() - 1);
+    shapes.reserve(s.size());
+    build(build_shapes, 0, build_shapes.size(), 0);
+}
+
+uint32_t BVH::build(vector<BVHBuildShape>& s, const unsigned int begin, const unsigned int end, const int depth){
+    uint32_t index = nodes.size();
+    nodes.push_back(BVHNode());
+
+    Vec3 low_corner = s[begin].low_corner, high_corner = s[begin].high_corner,
+         centroid_low = s[begin].centroid, centroid_high = s[begin].centroid;
+    for (unsigned int i = begin + 1; i < end; ++i){
+        growBounds(low_corner, high_corner, s[i].low_corner, s[i].high_corner);
+        growBounds(centroid_low, centroid_high, s[i].centroid, s[i].centroid);
+    }
+    nodes[index].low_corner = low_corner;
+    nodes[index].high_corner = high_corner;
+
+    unsigned int num_shapes = end - begin;
+
+    // Split along whichever axis the centroids are most spread out over.
+    Vec3 extent = centroid_high - centroid_low;
+    int axis = 0;
+    if (extent.y > extent[axis]){
+        axis = 1;
+    }
+    if (extent.z > extent[axis]){
+        axis = 2;
+    }
+
+    // There's no way to separate shapes whose centroids are all the same point.
+    bool make_leaf = num_shapes == 1 || depth == BVH_MAX_DEPTH || extent[axis] == 0;
+
+    int best_bucket = -1;
+    float low_bound = centroid_low[axis], inv_width = 0;
+    if (!make_leaf){
+        inv_width = BVH_BUCKETS / extent[axis];
+
+        unsigned int counts[BVH_BUCKETS];
+        Vec3 bucket_low[BVH_BUCKETS], bucket_high[BVH_BUCKETS];
+        fill(counts, counts + BVH_BUCKETS, 0);
+        for (unsigned int i = begin; i < end; ++i){
+            int b = bucketIndex(s[i], axis, low_bound, inv_width);
+            if (counts[b] == 0){
+                bucket_low[b] = s[i].low_corner;
+                bucket_high[b] = s[i].high_corner;
+            }
+            else{
+                growBounds(bucket_low[b], bucket_high[b], s[i].low_corner, s[i].high_corner);
+            }
+            ++counts[b];
+        }
+
+        // Sweep from the right to find the area of everything above each boundary, then
+        // from the left to cost each boundary.
+        float right_area[BVH_BUCKETS];
+        unsigned int right_count[BVH_BUCKETS];
+        Vec3 low, high;
+        unsigned int count = 0;
+        for (int b = BVH_BUCKETS - 1; b > 0; --b){
+            if (counts[b] > 0){
+                if (count == 0){
+                    low = bucket_low[b];
+                    high = bucket_high[b];
+                }
+                else{
+                    growBounds(low, high, bucket_low[b], bucket_high[b]);
+                }
+                count += counts[b];
+            }
+            right_count[b] = count;
+            right_area[b] = count > 0 ? surfaceArea(low, high) : 0;
+        }
+
+        float best_cost = numeric_limits<float>::infinity();
+        count = 0;
+        for (int b = 0; b < BVH_BUCKETS - 1; ++b){
+            if (counts[b] > 0){
+                if (count == 0){
+                    low = bucket_low[b];
+                    high = bucket_high[b];
+                }
+                else{
+                    growBounds(low, high, bucket_low[b], bucket_high[b]);
+                }
+                count += counts[b];
+            }
+            if (count == 0 || right_count[b + 1] == 0){
+                continue;
+            }
+            float cost = count * surfaceArea(low, high) + right_count[b + 1] * right_area[b + 1];
+            if (cost < best_cost){
+                best_cost = cost;
+                best_bucket = b;
+            }
+        }
+
+        float area = surfaceArea(low_corner, high_corner);
+        best_cost = BVH_TRAVERSAL_COST + (area > 0 ? best_cost / area : num_shapes);
+        if (best_bucket == -1 || (num_shapes <= BVH_MAX_LEAF_SHAPES && best_cost >= num_shapes)){
+            make_leaf = true;
+        }
+    }
+
+    // Shapes that can't be separated by their centroids still get split (arbitrarily, in half)
+    // to keep leaves small.
+    bool split_in_half = make_leaf && num_shapes > BVH_MAX_LEAF_SHAPES && depth < BVH_MAX_DEPTH;
+
+    if (make_leaf && !split_in_half){
+        assert(num_shapes <= numeric_limits<uint16_t>::max());
+        nodes[index].offset = shapes.size();
+        nodes[index].num_shapes = num_shapes;
+        nodes[index].axis = axis;
+        for (unsigned int i = begin; i < end; ++i){
+            shapes.push_back(s[i].shape);
+        }
+        return index;
+    }
+
+    // Keep shapes in scene order within each side so the tree (and which of two equally
+    // close hits wins) doesn't depend on how the partition shuffles them.
+    unsigned int split = begin + num_shapes / 2;
+    if (!split_in_half){
+        split = stable_partition(s.begin() + begin, s.begin() + end,
+                                 BVHBucketBelow(axis, low_bound, inv_width, best_bucket)) - s.begin();
+    }
+
+    nodes[index].num_shapes = 0;
+    nodes[index].axis = axis;
+    build(s, begin, split, depth + 1);
+    // Don't hold a reference across the recursive calls; the node array may reallocate.
+    uint32_t right = build(s, split, end, depth + 1);
+    nodes[index].offset = right;
+    return index;
+}
+
+// Return true if the ray enters the box before max_distance. Directions with a zero component
+// make the products below infinite (or NaN when the origin lies on the slab, in which case the
+// comparisons ignore that axis), so no special case is needed.
+inline bool hitsBox(const BVHNode& node, const Ray& r, const Vec3& inv_direction, const float max_distance){
+    float t_min = 0, t_max = max_distance;
+    for (int i = 0; i < 3; ++i){
+        float t_low = (node.low_corner[i] - r.origin[i]) * inv_direction[i],
+              t_high = (node.high_corner[i] - r.origin[i]) * inv_direction[i];
+        if (t_low > t_high){
+            swap(t_low, t_high);
+        }
+        if (t_low > t_min){
+            t_min = t_low;
+        }
+        if (t_high < t_max){
+            t_max = t_high;
+        }
+        if (t_min > t_max){
+            return false;
+        }
+    }
+    return true;
+}
+
+string BVH::statistics() const{
+    unsigned int leaves = 0;
+    for (vector<BVHNode>::const_iterator n_iter = nodes.begin(); n_iter != nodes.end(); ++n_iter){
+        leaves += n_iter->num_shapes > 0;
+    }
+    stringstream ss;
+    ss << nodes.size() << " nodes, " << leaves << " leaves, " << shapes.size() << " shapes";
+    return ss.str();
+}
+
+void BVH::collide(const Ray &r, Collision &c) const{
+    if (nodes.empty()){
+        return;
+    }
+    Vec3 inv_direction(1 / r.direction.x, 1 / r.direction.y, 1 / r.direction.z);
+    // Every push happens on the way down a single path, so the stack can never be deeper than the tree.
+    uint32_t stack[BVH_MAX_DEPTH + 1];
+    int stack_size = 0;
+    uint32_t current = 0;
+
+    Collision temp_collision;
+    while (true){
+        const BVHNode &node = nodes[current];
+        // Anything that starts beyond the closest hit so far can be skipped.
+        if (hitsBox(node, r, inv_direction, c.collided ? c.distance : numeric_limits<float>::infinity())){
+            if (node.num_shapes == 0){
+                // Visit the nearer child first so the closest hit is found sooner and more
+                // of the farther child gets culled.
+                if (r.direction[node.axis] < 0){
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                }
+                else{
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                }
+                continue;
+            }
+
+            for (uint32_t i = node.offset, end = node.offset + node.num_shapes; i < end; ++i){
+                temp_collision = shapes[i]->collide(r);
+                if (temp_collision.collided && (temp_collision.distance < c.distance || !c.collided)){
+                    c = temp_collision;
+                }
+            }
+        }
+        if (stack_size == 0){
+            return;
+        }
+        current = stack[--stack_size];
+    }
+}
+
+bool BVH::collideBoolean(const Ray &r, const float d, const Shape *&occluder) const{
+    if (nodes.empty()){
+        return false;
+    }
+    Vec3 inv_direction(1 / r.direction.x, 1 / r.direction.y, 1 / r.direction.z);
+    uint32_t stack[BVH_MAX_DEPTH + 1];
+    int stack_size = 0;
+    uint32_t current = 0;
+
+    Collision temp_collision;
+    while (true){
+        const BVHNode &node = nodes[current];
+        if (hitsBox(node, r, inv_direction, d)){
+            if (node.num_shapes == 0){
+                // Any hit will do, so the order children are visited in doesn't matter.
+                stack[stack_size++] = node.offset;
+                current = current + 1;
+                continue;
+            }
+
+            for (uint32_t i = node.offset, end = node.offset + node.num_shapes; i < end; ++i){
+                temp_collision = shapes[i]->collide(r);
+                if (temp_collision.collided && temp_collision.distance < d){
+                    occluder = shapes[i];
+                    return true;
+                }
+            }
+        }
+        if (stack_size == 0){
+            return false;
+        }
+        current = stack[--stack_size];
+    }
+}
@@ -0,0 +1,95 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "constants.h"
+
+#include "shapes.h"
+
+// The most shapes a leaf may hold. Leaves with fewer shapes can still be split if the surface
+// area heuristic says it's worth it.
+const unsigned int BVH_MAX_LEAF_SHAPES = 4;
+
+// The number of buckets centroids are sorted into along an axis when looking for a split.
+const int BVH_BUCKETS = 12;
+
+// The deepest a BVH is allowed to grow. This bounds the size of the traversal stack.
+const int BVH_MAX_DEPTH = 64;
+
+// One node of a BVH. Nodes are laid out depth first, so the left child of an interior node
+// immediately follows it and only the index of the right child needs to be stored.
+struct BVHNode{
+    // The bounds of everything under this node.
+    Vec3 low_corner, high_corner;
+
+    // Interior nodes: the index of the right child. Leaves: where this leaf's shapes
+    // begin in BVH::shapes.
+    uint32_t offset;
+
+    // Number of shapes in this leaf, or 0 for interior nodes.
+    uint16_t num_shapes;
+
+    // The axis the children were split over. Used to pick which child to visit first.
+    uint8_t axis;
+
+ private:
+    friend class boost::serialization::access;
+
+    template<class Archive>
+    void serialize(Archive &ar, const unsigned int version){
+        ar & low_corner;
+        ar & high_corner;
+        ar & offset;
+        ar & num_shapes;
+        ar & axis;
+    }
+};
+
+// Information about a shape only needed while building.
+struct BVHBuildShape{
+    Vec3 low_corner, high_corner, centroid;
+    Shape *shape;
+};
+
+// A bounding volume hierarchy over all the shapes in the scene. An alternative to KDTree
+// that references every shape exactly once, which suits scenes full of large overlapping
+// shapes. It has the same collision interface as KDTree.
+class BVH{
+ public:
+    // Required by the serialization library indirectly through Raytracer.
+    BVH() {}
+
+    // Build a BVH over the given shapes using the surface area heuristic.
+    BVH(const vector<Shape*>&);
+
+    // Collide the ray with the BVH, updating the given Collision if a closer hit is found.
+    void collide(const Ray&, Collision&) const;
+
+    // Return true if the ray hits an object within the given distance, terminating as
+    // early as possible. The object that was hit is stored in the given shape pointer,
+    // which is left alone if nothing was hit.
+    bool collideBoolean(const Ray&, const float, const Shape*&) const;
+
+    // A short description of the size of the BVH, for reporting after it's built.
+    string statistics() const;
+
+ private:
+    // Build the subtree over the given range [begin, end) of shapes, appending its nodes
+    // depth first. Returns the index of the subtree's root.
+    uint32_t build(vector<BVHBuildShape>&, const unsigned int, const unsigned int, const int);
+
+    // All the nodes of the hierarchy. The root is at index 0.
+    vector<BVHNode> nodes;
+
+    // The shapes, ordered so that every leaf's shapes are next to each other.
+    vector<Shape*> shapes;
+
+    friend class boost::serialization::access;
+
+    template<class Archive>
+    void serialize(Archive &ar, const unsigned int version){
+        ar & nodes;
+        ar & shapes;
+    }
+};
+
+#endif
@@ -41,8 +41,9 @@ const float EPSILON = 1.0 / 100;
 // Below this threshold, reflection calculated with Fresnel's equations is ignored.
 const float FRESNEL_REFLECTIVE_MIN = 0.025;
 
-// How many tiles pixels along one side of a tile. TILE_SIDE_LENGTH ^ 2 is the size of a tile.
-// const int TILE_SIDE_LENGTH = 32;
+// How many pixels along one side of a tile. TILE_SIDE_LENGTH ^ 2 is the size of a tile. Must be a
+// power of two, since pixels within a tile are traced in Z-order.
+const int TILE_SIDE_LENGTH = 16;
 
 // degrees * DEG_TO_RAD = radians
 const float DEG_TO_RAD = 0.0174532925;
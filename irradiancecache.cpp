@@ -0,0 +1,122 @@
+#include "irradiancecache.h"
+
+#include <algorithm>
+#include <cmath>
+#include <boost/thread/locks.hpp>
+
+IrradianceCacheNode::IrradianceCacheNode(){
+    fill(children, children + 8, (IrradianceCacheNode*) NULL);
+}
+
+IrradianceCacheNode::~IrradianceCacheNode(){
+    for (int i = 0; i < 8; ++i){
+        delete children[i];
+    }
+}
+
+IrradianceCache::IrradianceCache() : half_size(0), root(new IrradianceCacheNode()), num_samples(0) {}
+
+IrradianceCache::IrradianceCache(const Vec3 &low_corner, const Vec3 &high_corner) : root(new IrradianceCacheNode()), num_samples(0){
+    center = (low_corner + high_corner) * 0.5;
+    Vec3 extent = high_corner - low_corner;
+    half_size = max(extent.x, max(extent.y, extent.z)) * 0.5;
+}
+
+IrradianceCache::~IrradianceCache(){
+    delete root;
+}
+
+unsigned int IrradianceCache::size() const{
+    boost::shared_lock<boost::shared_mutex> lock(mutex);
+    return num_samples;
+}
+
+void IrradianceCache::add(const Vec3 &point, const Vec3 &normal, const Color &irradiance, const float radius){
+    IrradianceSample sample;
+    sample.point = point;
+    sample.normal = normal;
+    sample.irradiance = irradiance;
+    sample.radius = min(max(radius, 2 * half_size * IRRADIANCE_CACHE_MIN_RADIUS), 2 * half_size * IRRADIANCE_CACHE_MAX_RADIUS);
+
+    boost::unique_lock<boost::shared_mutex> lock(mutex);
+    add(root, center, half_size, sample, sample.radius * IRRADIANCE_CACHE_ERROR, 0);
+    ++num_samples;
+}
+
+void IrradianceCache::add(IrradianceCacheNode *node, const Vec3 &node_center, const float node_half_size,
+                          const IrradianceSample &sample, const float valid_distance, const int depth){
+    // Store the sample in the first nodes no bigger than the area it's valid over, so a lookup
+    // only has to check the nodes on the path down to the point being looked up.
+    if (node_half_size <= valid_distance || depth == IRRADIANCE_CACHE_MAX_DEPTH){
+        node->samples.push_back(sample);
+        return;
+    }
+
+    float child_half_size = node_half_size * 0.5;
+    for (int i = 0; i < 8; ++i){
+        Vec3 child_center = node_center;
+        bool overlaps = true;
+        for (int axis = 0; axis < 3; ++axis){
+            bool high = (i >> axis) & 1;
+            child_center[axis] += high ? child_half_size : -child_half_size;
+            // Compare the child's half of this axis with the box around the sample's sphere.
+            if (high ? sample.point[axis] + valid_distance < node_center[axis] :
+                       sample.point[axis] - valid_distance > node_center[axis]){
+                overlaps = false;
+            }
+        }
+        if (overlaps){
+            if (node->children[i] == NULL){
+                node->children[i] = new IrradianceCacheNode();
+            }
+            add(node->children[i], child_center, child_half_size, sample, valid_distance, depth + 1);
+        }
+    }
+}
+
+bool IrradianceCache::interpolate(const Vec3 &point, const Vec3 &normal, Color &irradiance) const{
+    boost::shared_lock<boost::shared_mutex> lock(mutex);
+
+    Color total;
+    float total_weight = 0;
+    const IrradianceCacheNode *node = root;
+    Vec3 node_center = center;
+    float node_half_size = half_size;
+    while (node != NULL){
+        for (vector<IrradianceSample>::const_iterator s_iter = node->samples.begin(); s_iter != node->samples.end(); ++s_iter){
+            Vec3 offset = point - s_iter->point;
+            // Ward's error estimate, from how far apart the points are relative to the sample's
+            // radius and how far apart the normals are.
+            float error = offset.magnitude() / s_iter->radius + sqrt(max<float>(0, 1 - normal.dot(s_iter->normal)));
+            if (error >= IRRADIANCE_CACHE_ERROR){
+                continue;
+            }
+            // Samples in front of the point see things the point doesn't.
+            if (offset.dot(normal + s_iter->normal) < -EPSILON){
+                continue;
+            }
+            float weight = 1 / max<float>(error, 1e-6);
+            total += s_iter->irradiance * weight;
+            total_weight += weight;
+        }
+
+        int child = 0;
+        node_half_size *= 0.5;
+        for (int axis = 0; axis < 3; ++axis){
+            if (point[axis] >= node_center[axis]){
+                child |= 1 << axis;
+                node_center[axis] += node_half_size;
+            }
+            else{
+                node_center[axis] -= node_half_size;
+            }
+        }
+        node = node->children[child];
+    }
+
+    if (total_weight == 0){
+        return false;
+    }
+    irradiance = total / total_weight;
+    return true;
+}
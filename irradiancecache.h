@@ -0,0 +1,99 @@
+#ifndef IRRADIANCECACHE_H
+#define IRRADIANCECACHE_H
+
+#include "constants.h"
+
+#include <vector>
+#include <boost/thread/shared_mutex.hpp>
+
+#include "vec3.h"
+
+// The largest error (Ward's a) a cached sample can have at a point and still be used there.
+// Smaller values mean more samples and smoother results.
+const float IRRADIANCE_CACHE_ERROR = 0.2;
+
+// Bounds on a sample's radius, as fractions of the size of the cache. Without them, samples
+// in corners are valid almost nowhere and samples facing open space are valid everywhere.
+const float IRRADIANCE_CACHE_MIN_RADIUS = 0.005;
+const float IRRADIANCE_CACHE_MAX_RADIUS = 0.25;
+
+// The deepest a sample is stored in the octree.
+const int IRRADIANCE_CACHE_MAX_DEPTH = 20;
+
+// Irradiance computed at one point.
+struct IrradianceSample{
+    Vec3 point, normal;
+    Color irradiance;
+
+    // The harmonic mean distance to the surfaces seen from the point, which says how quickly
+    // the irradiance is likely to change around it.
+    float radius;
+};
+
+// A cube of the octree. Its bounds are implied by its position in the tree.
+struct IrradianceCacheNode{
+    IrradianceCacheNode();
+    ~IrradianceCacheNode();
+
+    // Samples whose area of validity is about the size of this node and overlaps it.
+    vector<IrradianceSample> samples;
+
+    // Indexed by a bit per axis, set for the high half. NULL until something is stored there.
+    IrradianceCacheNode *children[8];
+};
+
+// Ward's irradiance cache: samples of irradiance, computed lazily wherever no existing sample
+// is close enough, and reused by interpolation everywhere they're valid. Samples are kept in
+// an octree over the scene. Any number of threads can look up and add samples at once.
+class IrradianceCache{
+ public:
+    // Required by the serialization library indirectly through Raytracer.
+    IrradianceCache();
+
+    // Create an empty cache covering the box given by its low and high corners.
+    IrradianceCache(const Vec3&, const Vec3&);
+
+    ~IrradianceCache();
+
+    // Interpolate the irradiance at the given point on a surface with the given normal from
+    // the samples valid there, storing it in the given color. Return false, leaving the color
+    // alone, if there are none.
+    bool interpolate(const Vec3&, const Vec3&, Color&) const;
+
+    // Add a sample with the given point, normal, irradiance and harmonic mean distance.
+    void add(const Vec3&, const Vec3&, const Color&, const float);
+
+    // How many samples have been added.
+    unsigned int size() const;
+
+ private:
+    // Not copyable, since it owns its nodes and a mutex.
+    IrradianceCache(const IrradianceCache&);
+    IrradianceCache& operator=(const IrradianceCache&);
+
+    // Store the given sample, which is valid within the given distance of its point, in the
+    // given node, with the given center and half of its side length, or its descendants.
+    void add(IrradianceCacheNode*, const Vec3&, const float, const IrradianceSample&, const float, const int);
+
+    // The center of the cube the octree covers, and half of its side length.
+    Vec3 center;
+    float half_size;
+
+    IrradianceCacheNode *root;
+
+    unsigned int num_samples;
+
+    // Lookups share this; adding a sample takes it exclusively.
+    mutable boost::shared_mutex mutex;
+
+    friend class boost::serialization::access;
+
+    // Only the bounds are sent. Every process fills its own cache.
+    template<class Archive>
+    void serialize(Archive &ar, const unsigned int version){
+        ar & center;
+        ar & half_size;
+    }
+};
+
+#endif
@@ -1,77 +1,179 @@
 #include "kdtree.h"
 
 #include <algorithm>
-#include <set>
 #include <cassert>
+#include <cmath>
 #include <limits>
+#include <sstream>
+#include <boost/bind.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 
 #define LEFT 0
 #define RIGHT 1
 
+// Which children a shape belongs to once its node has been split.
+enum {SIDE_BOTH = 0, SIDE_LEFT = 1, SIDE_RIGHT = 2};
+
 // long kd_recurses = 0, objects_checked = 0;
 
-// Stores all the information for a potential partition in the kd-tree.
-struct PartitionInfo{
-    PartitionInfo(const Vec3& low_corner, const Vec3& high_corner, const int axis, const float distance) : count_left(0), 
-                                                                                                           count_right(0), 
-                                                                                                           partition_distance(distance){
-        Vec3 mid_low_corner = low_corner,
-             mid_high_corner = high_corner;
-        mid_low_corner[axis] = mid_high_corner[axis] = distance;
-        Vec3 left_dims = mid_high_corner - low_corner,
-             right_dims = high_corner - mid_low_corner;
-        surface_area_left = 2 * (left_dims.x * left_dims.y + left_dims.y * left_dims.z + left_dims.z * left_dims.x);
-        surface_area_right = 2 * (right_dims.x * right_dims.y + right_dims.y * right_dims.z + right_dims.z * right_dims.x);
-    }
+// Totals for KD_COUNT_SHAPE_TESTS, shared by all threads.
+unsigned long kd_shape_tests = 0, kd_shape_tests_skipped = 0;
+boost::mutex kd_shape_tests_mutex;
+
+inline float surfaceArea(const Vec3& low_corner, const Vec3& high_corner){
+    Vec3 dims = high_corner - low_corner;
+    return 2 * (dims.x * dims.y + dims.y * dims.z + dims.z * dims.x);
+}
+
+void sortEvents(vector<KDEvent> *events){
+    sort(events->begin(), events->end());
+}
+
+// Builds one subtree on its own thread. Boost.Thread copies this, so everything is held
+// by pointer and the result is written back through one.
+struct KDBuildTask{
+    KDBuildTask(KDNode **result, vector<KDEvent> *events, const unsigned int num_shapes, const Vec3 &low, const Vec3 &high,
+                const int depth, const int threads, const unsigned int total_shapes) : result(result),
+                                                                                       events(events),
+                                                                                       num_shapes(num_shapes),
+                                                                                       low_corner(low),
+                                                                                       high_corner(high),
+                                                                                       depth(depth),
+                                                                                       threads(threads),
+                                                                                       total_shapes(total_shapes) {}
 
-    bool operator<(const PartitionInfo& other) const{
-        return partition_distance < other.partition_distance;
+    void operator()(){
+        // Every thread needs its own scratch space.
+        vector<uint8_t> sides(total_shapes);
+        *result = new KDNode(*events, num_shapes, low_corner, high_corner, depth, threads, sides);
     }
 
-    int count_left, count_right;
-    float partition_distance, surface_area_left, surface_area_right;
+    KDNode **result;
+    vector<KDEvent> *events;
+    unsigned int num_shapes;
+    Vec3 low_corner, high_corner;
+    int depth, threads;
+    unsigned int total_shapes;
 };
 
-// Return the index of the partition with the given distance. Due to the nature of the creation of the vector, 
-// it's guaranteed to be unique if it exists. If it doesn't, then it can only ever be smaller than the first
-// element or larger than the last, so we return -1 or partitions.size() (before the first and after the last
-// indices, respectively) in the appropriate case. Additionally, the values we are comparing will always be
-// exactly equal if they're the one we want (even though they are floats).
-int binarySearchPartitions(const vector<PartitionInfo>& partitions, const float distance){
-    if (distance < partitions.front().partition_distance){
-        return -1;
+// The binned build's counterpart of KDBuildTask.
+struct KDBinnedBuildTask{
+    KDBinnedBuildTask(KDNode **result, vector<uint32_t> *shapes, const KDShapeBounds *bounds, const Vec3 &low, const Vec3 &high,
+                      const int depth, const int threads) : result(result),
+                                                            shapes(shapes),
+                                                            bounds(bounds),
+                                                            low_corner(low),
+                                                            high_corner(high),
+                                                            depth(depth),
+                                                            threads(threads) {}
+
+    void operator()(){
+        *result = new KDNode(*shapes, *bounds, low_corner, high_corner, depth, threads);
     }
-    else if (distance > partitions.back().partition_distance){
-        return partitions.size();
+
+    KDNode **result;
+    vector<uint32_t> *shapes;
+    const KDShapeBounds *bounds;
+    Vec3 low_corner, high_corner;
+    int depth, threads;
+};
+
+// Which of the given number of bins, starting at low_bound, the given value falls into.
+inline int binIndex(const float value, const float low_bound, const float inv_width, const int bins){
+    float bin = (value - low_bound) * inv_width;
+    if (bin < 0){
+        return 0;
     }
-    unsigned left = 0, right = partitions.size() - 1, index;
-    while (true){
-        // Quick division by two using bit shift!
-        index = (left + right) >> 1;
-        if (partitions[index].partition_distance == distance){
-            return index;
-        }
-        else if (partitions[index].partition_distance > distance){
-            right = index - 1;
-        }
-        else{
-            left = index + 1;
-        }
+    if (bin > bins - 1){
+        return bins - 1;
     }
+    return (int) bin;
 }
 
-KDNode::KDNode(const vector<Shape*>& s) : shapes(s){
+KDNode::KDNode(const vector<Shape*>& s, const int threads, const int bins){
     if (s.size() > 0){
-        calculateAggregateBounds();
+        calculateAggregateBounds(s);
     }
     else{
         low_corner = high_corner = Vec3();
     }
-    split();
+
+    if (bins > 0){
+        KDShapeBounds bounds;
+        bounds.bins = min(bins, KD_MAX_BINS);
+        bounds.low_corners.resize(s.size());
+        bounds.high_corners.resize(s.size());
+        shapes.resize(s.size());
+        for (uint32_t i = 0; i < s.size(); ++i){
+            for (int a = 0; a < 3; ++a){
+                bounds.low_corners[i][a] = s[i]->extremeValue(a, EXTREME_VALUE_SMALLEST);
+                bounds.high_corners[i][a] = s[i]->extremeValue(a, EXTREME_VALUE_LARGEST);
+            }
+            shapes[i] = i;
+        }
+        splitBinned(bounds, 0, threads);
+        return;
+    }
+
+    // This is the only sort done for the whole tree. Every node after this one splits
+    // its sorted events between its children in a way that keeps them sorted. Events
+    // sort by axis first, so each axis can be sorted separately and then appended.
+    vector<KDEvent> axis_events[3];
+    for (uint8_t a = 0; a < 3; ++a){
+        axis_events[a].reserve(s.size() * 2);
+        for (uint32_t i = 0; i < s.size(); ++i){
+            float smallest = s[i]->extremeValue(a, EXTREME_VALUE_SMALLEST),
+                  largest = s[i]->extremeValue(a, EXTREME_VALUE_LARGEST);
+            if (smallest == largest){
+                axis_events[a].push_back(KDEvent(smallest, i, a, KD_EVENT_PLANAR));
+            }
+            else{
+                axis_events[a].push_back(KDEvent(smallest, i, a, KD_EVENT_START));
+                axis_events[a].push_back(KDEvent(largest, i, a, KD_EVENT_END));
+            }
+        }
+    }
+    boost::thread_group sorters;
+    for (int a = 1; a < 3; ++a){
+        if (a < threads){
+            sorters.create_thread(boost::bind(&sortEvents, &axis_events[a]));
+        }
+        else{
+            sortEvents(&axis_events[a]);
+        }
+    }
+    sortEvents(&axis_events[X_AXIS]);
+    sorters.join_all();
+
+    vector<KDEvent> events;
+    events.reserve(axis_events[X_AXIS].size() + axis_events[Y_AXIS].size() + axis_events[Z_AXIS].size());
+    for (int a = 0; a < 3; ++a){
+        events.insert(events.end(), axis_events[a].begin(), axis_events[a].end());
+        vector<KDEvent>().swap(axis_events[a]);
+    }
+
+    vector<uint8_t> sides(s.size());
+    split(events, s.size(), 0, threads, sides);
+}
+
+KDNode::KDNode(vector<KDEvent>& events, const unsigned int num_shapes, const Vec3& low, const Vec3& high, const int depth,
+               const int threads, vector<uint8_t>& sides) : low_corner(low), high_corner(high){
+    split(events, num_shapes, depth, threads, sides);
+}
+
+KDNode::KDNode(vector<uint32_t>& s, const KDShapeBounds& bounds, const Vec3& low, const Vec3& high, const int depth,
+               const int threads) : low_corner(low), high_corner(high){
+    shapes.swap(s);
+    splitBinned(bounds, depth, threads);
 }
 
-KDNode::KDNode(const vector<Shape*>& s, const Vec3& low, const Vec3& high) : low_corner(low), high_corner(high), shapes(s){
-    split();
+KDNode::~KDNode(){
+    delete children[LEFT];
+    delete children[RIGHT];
 }
 
 void KDNode::print(const int depth) const{
@@ -80,9 +182,7 @@ void KDNode::print(const int depth) const{
         low_corner.print(false);
         cout << " to ";
         high_corner.print(false);
-        cout << "; surface area = ";
-        Vec3 tmp = high_corner - low_corner;
-        cout << (2 * (tmp.x * tmp.y + tmp.y * tmp.z + tmp.z * tmp.x)) << endl;
+        cout << "; surface area = " << surfaceArea(low_corner, high_corner) << endl;
     }
     else{
         cout << string(depth, ' ') << "internal node split at " << partition_distance << " over " << axis << endl;
@@ -91,283 +191,903 @@ void KDNode::print(const int depth) const{
     }
 }
 
-void KDNode::collide(const Ray& r, Collision &c) const{
-    // kd_recurses++;
+bool KDNode::findSplit(const vector<KDEvent>& events, const unsigned int num_shapes, const int threads, int& best_axis, float& best_distance) const{
+    // Find where each axis' events begin. Events are sorted by axis first.
+    vector<KDEvent>::const_iterator axis_begin[4];
+    axis_begin[X_AXIS] = events.begin();
+    axis_begin[LEAF] = events.end();
+    for (int a = 1; a < 3; ++a){
+        axis_begin[a] = axis_begin[a - 1];
+        while (axis_begin[a] != events.end() && axis_begin[a]->axis < a){
+            ++axis_begin[a];
+        }
+    }
 
-    if (axis == LEAF){
-        Collision temp_collision;
-        // objects_checked += shapes.size();
-        for (vector<Shape*>::const_iterator s_iter = shapes.begin(); s_iter != shapes.end(); ++s_iter){
-            temp_collision = (*s_iter)->collide(r);
-            if (temp_collision.collided && (temp_collision.distance < c.distance || !c.collided)){
-                c = temp_collision;
-            }
+    // This is the baseline cost the partitioning schemes must beat.
+    float costs[3], distances[3];
+    for (int a = 0; a < 3; ++a){
+        costs[a] = 1.0f * num_shapes;
+        distances[a] = 0;
+    }
+
+    boost::thread_group sweepers;
+    for (int a = 1; a < 3; ++a){
+        if (a < threads && num_shapes >= KD_PARALLEL_THRESHOLD){
+            sweepers.create_thread(boost::bind(&KDNode::sweepAxis, this, axis_begin[a], axis_begin[a + 1], num_shapes, &costs[a], &distances[a]));
+        }
+        else{
+            sweepAxis(axis_begin[a], axis_begin[a + 1], num_shapes, &costs[a], &distances[a]);
         }
     }
-    else{
-        // There is a collision with the splitting plane anywhere.
-        if (r.direction[axis] != 0){
-            // Optimized/simplified ray-plane intersection math.
-            float t = (partition_distance - r.origin[axis]) / r.direction[axis];
-            if (t < 0){
-                // Ray is facing away from splitting plane and so only hits one child.
-                collideOneChild(r, c);
-                return;
-            }
-            Vec3 point = r.pointAt(t);
-            if (low_corner < point && point < high_corner){
-                // The ray hit the splitting plane, so it must hit both children!
-                children[LEFT]->collide(r, c);
-                children[RIGHT]->collide(r, c);
-                
-                /*
-                // Check which child is the near and check it first.
-                int near_index = r.origin[axis] < point[axis] ? LEFT : RIGHT;
-                Collision near_collision;
-                children[near_index]->collide(r, near_collision);
-                if (near_collision.collided && (!c.collided || near_collision.distance < c.distance)){
-                    c = near_collision;
-                }
-                else{
-                    children[1 - near_index]->collide(r, c);
-                }
-                */
-                
+    sweepAxis(axis_begin[X_AXIS], axis_begin[Y_AXIS], num_shapes, &costs[X_AXIS], &distances[X_AXIS]);
+    sweepers.join_all();
+
+    // Figure out the axis with the best score.
+    float best_cost = 1.0f * num_shapes;
+    best_axis = LEAF;
+    for (int a = 0; a < 3; ++a){
+        if (costs[a] < best_cost){
+            best_cost = costs[a];
+            best_axis = a;
+            best_distance = distances[a];
+        }
+    }
+
+    return best_axis != LEAF;
+}
+
+void KDNode::sweepAxis(vector<KDEvent>::const_iterator e_iter, vector<KDEvent>::const_iterator end, const unsigned int num_shapes,
+                       float *best_cost, float *best_distance) const{
+    if (e_iter == end){
+        return;
+    }
+    int a = e_iter->axis;
+    float inv_surface_area_current = 1 / surfaceArea(low_corner, high_corner);
+
+    // Sweep left to right. At any plane, a shape is on the left if it begins before the plane
+    // (or lies flat in it) and on the right if it ends after the plane.
+    unsigned int count_left = 0, count_right = num_shapes;
+    while (e_iter != end){
+        float distance = e_iter->position;
+        unsigned int ending = 0, planar = 0, starting = 0;
+        for (; e_iter != end && e_iter->position == distance && e_iter->type == KD_EVENT_END; ++e_iter){
+            ++ending;
+        }
+        for (; e_iter != end && e_iter->position == distance && e_iter->type == KD_EVENT_PLANAR; ++e_iter){
+            ++planar;
+        }
+        for (; e_iter != end && e_iter->position == distance && e_iter->type == KD_EVENT_START; ++e_iter){
+            ++starting;
+        }
+
+        count_right -= ending + planar;
+
+        // Cut out any partitions that are on the boundary of this box.
+        if (distance > low_corner[a] && distance < high_corner[a]){
+            Vec3 mid_low_corner = low_corner, mid_high_corner = high_corner;
+            mid_low_corner[a] = mid_high_corner[a] = distance;
+            // 1.5 is traversal cost, 1.0 is the cost of doing an intersection. Can be tweaked.
+            float cost = 2.5f + 0.9f * (surfaceArea(low_corner, mid_high_corner) * (count_left + planar) * inv_surface_area_current +
+                                         surfaceArea(mid_low_corner, high_corner) * count_right * inv_surface_area_current);
+            if (cost < *best_cost){
+                *best_cost = cost;
+                *best_distance = distance;
             }
-            else{
-                // The ray missed the plane even though it was facing it, but it still
-                // hits one child.
-                collideOneChild(r, c);
+        }
+
+        count_left += starting + planar;
+    }
+}
+
+void KDNode::split(vector<KDEvent>& events, const unsigned int num_shapes, const int depth, const int threads, vector<uint8_t>& sides){
+    children[LEFT] = children[RIGHT] = NULL;
+    partition_distance = 0;
+    if (num_shapes < KD_SPLIT_THRESHOLD || depth == KD_MAX_DEPTH || !findSplit(events, num_shapes, threads, axis, partition_distance)){
+        axis = LEAF;
+        // Every shape has exactly one start or planar event along each axis.
+        shapes.reserve(num_shapes);
+        for (vector<KDEvent>::const_iterator e_iter = events.begin(); e_iter != events.end() && e_iter->axis == X_AXIS; ++e_iter){
+            if (e_iter->type != KD_EVENT_END){
+                shapes.push_back(e_iter->shape);
             }
         }
-        // The ray only passes through one child.
-        else{
-            // Since the ray is parallel to the splitting plane, we can shortcut the ray-box
-            // intersection: the ray will stay on whatever side it is on right now.
-            if (r.origin[axis] < partition_distance){
-                children[LEFT]->collide(r, c);
+        // Keep the shapes in scene order, which decides which of two equally distant hits wins.
+        sort(shapes.begin(), shapes.end());
+        vector<KDEvent>().swap(events);
+        return;
+    }
+
+    // Classify the shapes using their events along the splitting axis. Shapes ending at or before
+    // the plane only go left, shapes starting at or after it only go right, and the rest straddle
+    // the plane and go to both sides.
+    for (vector<KDEvent>::const_iterator e_iter = events.begin(); e_iter != events.end(); ++e_iter){
+        if (e_iter->axis == axis && e_iter->type != KD_EVENT_END){
+            sides[e_iter->shape] = SIDE_BOTH;
+        }
+    }
+    for (vector<KDEvent>::const_iterator e_iter = events.begin(); e_iter != events.end(); ++e_iter){
+        if (e_iter->axis != axis){
+            continue;
+        }
+        if (e_iter->type == KD_EVENT_END && e_iter->position <= partition_distance){
+            sides[e_iter->shape] = SIDE_LEFT;
+        }
+        else if (e_iter->type == KD_EVENT_START && e_iter->position >= partition_distance){
+            sides[e_iter->shape] = SIDE_RIGHT;
+        }
+        else if (e_iter->type == KD_EVENT_PLANAR){
+            sides[e_iter->shape] = e_iter->position <= partition_distance ? SIDE_LEFT : SIDE_RIGHT;
+        }
+    }
+    unsigned int num_left = 0, num_right = 0;
+    for (vector<KDEvent>::const_iterator e_iter = events.begin(); e_iter != events.end() && e_iter->axis == X_AXIS; ++e_iter){
+        if (e_iter->type != KD_EVENT_END){
+            num_left += sides[e_iter->shape] != SIDE_RIGHT;
+            num_right += sides[e_iter->shape] != SIDE_LEFT;
+        }
+    }
+
+    // Hand the events down to the children. Filtering keeps them sorted. The only events that
+    // change are those of straddling shapes along the splitting axis, which get clipped to the
+    // plane: they all end up at the same position, so merging them back in keeps the order too.
+    vector<KDEvent> left_events, right_events, left_clipped, right_clipped;
+    for (vector<KDEvent>::const_iterator e_iter = events.begin(); e_iter != events.end(); ++e_iter){
+        switch (sides[e_iter->shape]){
+        case SIDE_LEFT:
+            left_events.push_back(*e_iter);
+            break;
+
+        case SIDE_RIGHT:
+            right_events.push_back(*e_iter);
+            break;
+
+        default:
+            if (e_iter->axis != axis){
+                left_events.push_back(*e_iter);
+                right_events.push_back(*e_iter);
+            }
+            else if (e_iter->type == KD_EVENT_START){
+                left_events.push_back(*e_iter);
+                right_clipped.push_back(KDEvent(partition_distance, e_iter->shape, axis, KD_EVENT_START));
             }
             else{
-                children[RIGHT]->collide(r, c);
+                left_clipped.push_back(KDEvent(partition_distance, e_iter->shape, axis, KD_EVENT_END));
+                right_events.push_back(*e_iter);
             }
         }
     }
+    vector<KDEvent>().swap(events);
+
+    vector<KDEvent> merged(left_events.size() + left_clipped.size());
+    merge(left_events.begin(), left_events.end(), left_clipped.begin(), left_clipped.end(), merged.begin());
+    merged.swap(left_events);
+    merged.resize(right_events.size() + right_clipped.size());
+    merge(right_events.begin(), right_events.end(), right_clipped.begin(), right_clipped.end(), merged.begin());
+    merged.swap(right_events);
+    vector<KDEvent>().swap(merged);
+    vector<KDEvent>().swap(left_clipped);
+    vector<KDEvent>().swap(right_clipped);
+
+    Vec3 high_mid_corner = high_corner, low_mid_corner = low_corner;
+    high_mid_corner[axis] = low_mid_corner[axis] = partition_distance;
+
+    if (threads > 1 && min(num_left, num_right) >= KD_PARALLEL_THRESHOLD){
+        // The subtrees share nothing, so build the left one on a new thread while this one builds
+        // the right. Each side gets half of the threads to pass on to its own children.
+        int left_threads = threads / 2;
+        boost::thread left_builder(KDBuildTask(&children[LEFT], &left_events, num_left, low_corner, high_mid_corner, depth + 1,
+                                               left_threads, sides.size()));
+        children[RIGHT] = new KDNode(right_events, num_right, low_mid_corner, high_corner, depth + 1, threads - left_threads, sides);
+        left_builder.join();
+    }
+    else{
+        children[LEFT] = new KDNode(left_events, num_left, low_corner, high_mid_corner, depth + 1, threads, sides);
+        children[RIGHT] = new KDNode(right_events, num_right, low_mid_corner, high_corner, depth + 1, threads, sides);
+    }
 }
 
-bool KDNode::collideBoolean(const Ray& r, const float d) const{
-    // kd_recurses++;
+bool KDNode::findBinnedSplit(const KDShapeBounds& bounds, int& best_axis, float& best_distance) const{
+    float inv_surface_area_current = 1 / surfaceArea(low_corner, high_corner);
 
-    if (axis == LEAF){
-        Collision temp_collision;
-        // objects_checked += shapes.size();
-        for (vector<Shape*>::const_iterator s_iter = shapes.begin(); s_iter != shapes.end(); ++s_iter){
-            temp_collision = (*s_iter)->collide(r);
-            if (temp_collision.collided && temp_collision.distance < d){
-                return true;
+    // This is the baseline cost the partitioning schemes must beat.
+    float best_cost = 1.0f * shapes.size();
+    best_axis = LEAF;
+
+    unsigned int starting[KD_MAX_BINS], ending[KD_MAX_BINS];
+    for (int a = 0; a < 3; ++a){
+        float low_bound = low_corner[a], width = (high_corner[a] - low_bound) / bounds.bins;
+        if (width <= 0){
+            continue;
+        }
+        float inv_width = 1 / width;
+
+        fill(starting, starting + bounds.bins, 0);
+        fill(ending, ending + bounds.bins, 0);
+        for (vector<uint32_t>::const_iterator s_iter = shapes.begin(); s_iter != shapes.end(); ++s_iter){
+            ++starting[binIndex(bounds.low_corners[*s_iter][a], low_bound, inv_width, bounds.bins)];
+            ++ending[binIndex(bounds.high_corners[*s_iter][a], low_bound, inv_width, bounds.bins)];
+        }
+
+        // At the boundary where bin k begins, a shape is on the left if it starts in an earlier bin and on
+        // the right unless it ends in an earlier bin.
+        unsigned int count_left = 0, count_right = shapes.size();
+        for (int k = 1; k < bounds.bins; ++k){
+            count_left += starting[k - 1];
+            count_right -= ending[k - 1];
+
+            float distance = low_bound + k * width;
+            Vec3 mid_low_corner = low_corner, mid_high_corner = high_corner;
+            mid_low_corner[a] = mid_high_corner[a] = distance;
+            // Same costs as the exact build.
+            float cost = 2.5f + 0.9f * (surfaceArea(low_corner, mid_high_corner) * count_left * inv_surface_area_current +
+                                         surfaceArea(mid_low_corner, high_corner) * count_right * inv_surface_area_current);
+            if (cost < best_cost){
+                best_cost = cost;
+                best_axis = a;
+                best_distance = distance;
             }
         }
-        return false;
+    }
+
+    return best_axis != LEAF;
+}
+
+void KDNode::splitBinned(const KDShapeBounds& bounds, const int depth, const int threads){
+    children[LEFT] = children[RIGHT] = NULL;
+    partition_distance = 0;
+    if (shapes.size() < KD_SPLIT_THRESHOLD || depth == KD_MAX_DEPTH || !findBinnedSplit(bounds, axis, partition_distance)){
+        // The shapes are still in scene order, since they are only ever filtered.
+        axis = LEAF;
+        return;
+    }
+
+    // Same rules as split(): shapes ending at or before the plane go left, shapes starting at or after it go
+    // right, and the rest straddle it and go to both sides.
+    vector<uint32_t> left_shapes, right_shapes;
+    for (vector<uint32_t>::const_iterator s_iter = shapes.begin(); s_iter != shapes.end(); ++s_iter){
+        float smallest = bounds.low_corners[*s_iter][axis], largest = bounds.high_corners[*s_iter][axis];
+        if (smallest < partition_distance || largest <= partition_distance){
+            left_shapes.push_back(*s_iter);
+        }
+        if (largest > partition_distance){
+            right_shapes.push_back(*s_iter);
+        }
+    }
+    vector<uint32_t>().swap(shapes);
+
+    Vec3 high_mid_corner = high_corner, low_mid_corner = low_corner;
+    high_mid_corner[axis] = low_mid_corner[axis] = partition_distance;
+
+    if (threads > 1 && min(left_shapes.size(), right_shapes.size()) >= KD_PARALLEL_THRESHOLD){
+        int left_threads = threads / 2;
+        boost::thread left_builder(KDBinnedBuildTask(&children[LEFT], &left_shapes, &bounds, low_corner, high_mid_corner, depth + 1,
+                                                     left_threads));
+        children[RIGHT] = new KDNode(right_shapes, bounds, low_mid_corner, high_corner, depth + 1, threads - left_threads);
+        left_builder.join();
     }
     else{
-        if (r.direction[axis] != 0){
-            float t = (partition_distance - r.origin[axis]) / r.direction[axis];
-            if (t < 0){
-                return collideOneChildBoolean(r, d);
-            }
-            Vec3 point = r.pointAt(t);
-            if (low_corner < point && point < high_corner){
-                if (r.origin[axis] < point[axis]){
-                    return children[LEFT]->collideBoolean(r, d) || children[RIGHT]->collideBoolean(r, d);
-                }
-                return children[RIGHT]->collideBoolean(r, d) || children[LEFT]->collideBoolean(r, d);
+        children[LEFT] = new KDNode(left_shapes, bounds, low_corner, high_mid_corner, depth + 1, threads);
+        children[RIGHT] = new KDNode(right_shapes, bounds, low_mid_corner, high_corner, depth + 1, threads);
+    }
+}
+
+void KDNode::calculateAggregateBounds(const vector<Shape*>& s){
+    low_corner =  Vec3( numeric_limits<float>::infinity(),  numeric_limits<float>::infinity(),  numeric_limits<float>::infinity());
+    high_corner = Vec3(-numeric_limits<float>::infinity(), -numeric_limits<float>::infinity(), -numeric_limits<float>::infinity());
+    vector<Shape*>::const_iterator iter;
+    for (iter = s.begin(); iter != s.end(); ++iter){
+        Shape *shape = *iter;
+        for (int i = 0; i < 3; ++i){
+            if (shape->extremeValue(i, EXTREME_VALUE_SMALLEST) < low_corner[i]){
+                low_corner[i] = shape->extremeValue(i, EXTREME_VALUE_SMALLEST);
             }
-            else{
-                return collideOneChildBoolean(r, d);
+            if (shape->extremeValue(i, EXTREME_VALUE_LARGEST) > high_corner[i]){
+                high_corner[i] = shape->extremeValue(i, EXTREME_VALUE_LARGEST);
             }
         }
+    }
+}
+
+// A node still waiting to be visited during traversal, along with the stretch of the
+// ray [t_min, t_max] that passes through it.
+struct KDStackEntry{
+    uint32_t node;
+    float t_min, t_max;
+};
+
+// Walk from the given node down to the first leaf the ray passes through, pushing the
+// far children that the ray also passes through onto the stack to be visited later.
+// Because the children of a node split it in two, the stretch of the ray inside each
+// child can be found from the splitting plane alone without storing any bounds.
+inline const KDFlatNode* descend(const vector<KDFlatNode> &nodes, const Ray &r, KDStackEntry &current,
+                                 KDStackEntry *stack, int &stack_size){
+    const KDFlatNode *node = &nodes[current.node];
+    while (!node->isLeaf()){
+        int axis = node->axis();
+        float origin = r.origin[axis], direction = r.direction[axis];
+        // The child the ray starts in. If it starts right on the plane, it belongs to
+        // whichever side it's heading towards.
+        bool left_near = origin < node->partition_distance || (origin == node->partition_distance && direction < 0);
+        uint32_t near = node->children() + (left_near ? LEFT : RIGHT),
+                 far =  node->children() + (left_near ? RIGHT : LEFT);
+
+        if (direction == 0){
+            // Parallel to the splitting plane: the ray will stay on whatever side it is on right now.
+            current.node = near;
+        }
         else{
-            if (r.origin[axis] < partition_distance){
-                return children[LEFT]->collideBoolean(r, d);
+            float t = (node->partition_distance - origin) / direction;
+            if (t > current.t_max || t <= 0){
+                // The ray is facing away from the plane or leaves this node before reaching it.
+                current.node = near;
+            }
+            else if (t < current.t_min){
+                // The ray crosses the plane before it even enters this node.
+                current.node = far;
             }
             else{
-                return children[RIGHT]->collideBoolean(r, d);
+                // The ray hits the splitting plane inside this node, so it passes through both children.
+                KDStackEntry &far_entry = stack[stack_size++];
+                far_entry.node = far;
+                far_entry.t_min = t;
+                far_entry.t_max = current.t_max;
+
+                current.node = near;
+                current.t_max = t;
             }
         }
+        // kd_recurses++;
+        node = &nodes[current.node];
     }
+    return node;
 }
 
-// Perform ray-box intersection tests to figure out which of the two children this ray hits.
-// See rectPrism::collide() for an explanation of this function.
-void KDNode::collideOneChild(const Ray& r, Collision &c) const{
-    Vec3 high_mid_corner(high_corner);
-    high_mid_corner[axis] = partition_distance;
-    for (int corner = 0; corner < 2; ++corner){
-        for (int i = 0; i < 3; ++i){
-            if (r.direction[i] != 0){
-                float t = (corner == 0 ? high_mid_corner[i] - r.origin[i] : low_corner[i] - r.origin[i]) / r.direction[i];
-                if (t < 0){
-                    continue;
+KDTree::KDTree(const vector<Shape*> &s, const int threads, const int bins) : shapes(s){
+    KDNode root(shapes, threads, bins);
+    low_corner = root.low_corner - Vec3(EPSILON, EPSILON, EPSILON);
+    high_corner = root.high_corner + Vec3(EPSILON, EPSILON, EPSILON);
+    nodes.resize(1);
+    compile(&root, 0);
+}
+
+void KDTree::compile(const KDNode *node, const uint32_t index){
+    if (node->axis == LEAF){
+        nodes[index].leaf = leaves.size();
+        nodes[index].flags = (node->shapes.size() << 2) | LEAF;
+
+        KDLeaf leaf;
+        leaf.first_sphere_block = sphere_blocks.size();
+        leaf.first_prism_block = prism_blocks.size();
+        leaf.first_shape = leaf_shapes.size();
+        leaf.num_spheres = leaf.num_prisms = leaf.num_shapes = 0;
+        for (vector<uint32_t>::const_iterator s_iter = node->shapes.begin(); s_iter != node->shapes.end(); ++s_iter){
+            const Shape *shape = shapes[*s_iter];
+            if (const Sphere *sphere = dynamic_cast<const Sphere*>(shape)){
+                int lane = leaf.num_spheres++ % KD_BLOCK_SIZE;
+                if (lane == 0){
+                    sphere_blocks.push_back(KDSphereBlock());
                 }
-                Vec3 point = r.pointAt(t);
-                point[i] -= (1 - 2 * corner) * EPSILON;
-                if (low_corner <= point && point <= high_mid_corner){
-                    // Collision with the left child.
-                    children[LEFT]->collide(r, c);
-                    return;
+                KDSphereBlock &block = sphere_blocks.back();
+                block.center_x[lane] = sphere->center.x;
+                block.center_y[lane] = sphere->center.y;
+                block.center_z[lane] = sphere->center.z;
+                block.radius[lane] = sphere->rad;
+                block.shape[lane] = *s_iter;
+            }
+            else if (const RectPrism *prism = dynamic_cast<const RectPrism*>(shape)){
+                int lane = leaf.num_prisms++ % KD_BLOCK_SIZE;
+                if (lane == 0){
+                    prism_blocks.push_back(KDPrismBlock());
                 }
+                KDPrismBlock &block = prism_blocks.back();
+                block.low_x[lane] = prism->low_corner.x;
+                block.low_y[lane] = prism->low_corner.y;
+                block.low_z[lane] = prism->low_corner.z;
+                block.high_x[lane] = prism->high_corner.x;
+                block.high_y[lane] = prism->high_corner.y;
+                block.high_z[lane] = prism->high_corner.z;
+                block.shape[lane] = *s_iter;
+            }
+            else{
+                leaf_shapes.push_back(*s_iter);
+                ++leaf.num_shapes;
+            }
+        }
+        // Unused lanes are never looked at, but give them something harmless so they don't
+        // go out over the network as garbage.
+        if (leaf.num_spheres % KD_BLOCK_SIZE != 0){
+            KDSphereBlock &block = sphere_blocks.back();
+            for (int lane = leaf.num_spheres % KD_BLOCK_SIZE; lane < KD_BLOCK_SIZE; ++lane){
+                block.center_x[lane] = block.center_y[lane] = block.center_z[lane] = block.radius[lane] = 0;
+                block.shape[lane] = 0;
+            }
+        }
+        if (leaf.num_prisms % KD_BLOCK_SIZE != 0){
+            KDPrismBlock &block = prism_blocks.back();
+            for (int lane = leaf.num_prisms % KD_BLOCK_SIZE; lane < KD_BLOCK_SIZE; ++lane){
+                block.low_x[lane] = block.low_y[lane] = block.low_z[lane] = 0;
+                block.high_x[lane] = block.high_y[lane] = block.high_z[lane] = 0;
+                block.shape[lane] = 0;
+            }
+        }
+        leaves.push_back(leaf);
+    }
+    else{
+        // Both children are allocated at once so that they end up next to each other.
+        uint32_t children = nodes.size();
+        nodes.resize(children + 2);
+        nodes[index].partition_distance = node->partition_distance;
+        nodes[index].flags = (children << 2) | node->axis;
+        compile(node->children[LEFT], children + LEFT);
+        compile(node->children[RIGHT], children + RIGHT);
+    }
+}
+
+string KDTree::statistics() const{
+    unsigned int references = 0;
+    for (vector<KDLeaf>::const_iterator l_iter = leaves.begin(); l_iter != leaves.end(); ++l_iter){
+        references += l_iter->num_spheres + l_iter->num_prisms + l_iter->num_shapes;
+    }
+    stringstream ss;
+    ss << nodes.size() << " nodes, " << leaves.size() << " leaves, " << references << " shape references";
+    return ss.str();
+}
+
+string KDTree::shapeTestStatistics(){
+    boost::mutex::scoped_lock lock(kd_shape_tests_mutex);
+    stringstream ss;
+    ss << kd_shape_tests << " shape intersections, " << kd_shape_tests_skipped << " repeats skipped by mailboxing";
+    if (kd_shape_tests + kd_shape_tests_skipped > 0){
+        ss << " (" << (100.0 * kd_shape_tests_skipped / (kd_shape_tests + kd_shape_tests_skipped)) << "%)";
+    }
+    return ss.str();
+}
+
+void KDTree::countShapeTests(const KDMailbox &mailbox){
+    if (KD_COUNT_SHAPE_TESTS){
+        boost::mutex::scoped_lock lock(kd_shape_tests_mutex);
+        kd_shape_tests += mailbox.tests;
+        kd_shape_tests_skipped += mailbox.skipped;
+    }
+}
+
+bool KDTree::clipToBounds(const Ray &r, float &t_min, float &t_max) const{
+    t_min = 0;
+    t_max = numeric_limits<float>::infinity();
+    for (int i = 0; i < 3; ++i){
+        if (r.direction[i] == 0){
+            if (r.origin[i] < low_corner[i] || r.origin[i] > high_corner[i]){
+                return false;
+            }
+            continue;
+        }
+        float inv_direction = 1 / r.direction[i];
+        float t_low = (low_corner[i] - r.origin[i]) * inv_direction,
+              t_high = (high_corner[i] - r.origin[i]) * inv_direction;
+        if (t_low > t_high){
+            swap(t_low, t_high);
+        }
+        t_min = max(t_min, t_low);
+        t_max = min(t_max, t_high);
+        if (t_min > t_max){
+            return false;
+        }
+    }
+    return true;
+}
+
+// Keep the given hit if it's closer than the closest so far. Ties go to the shape listed
+// first in the scene, which is the order shapes used to be checked in.
+inline void keepCloser(const float distance, const uint32_t shape, float &closest, uint32_t &closest_shape){
+    if (distance < closest || (distance == closest && shape < closest_shape)){
+        closest = distance;
+        closest_shape = shape;
+    }
+}
+
+// Intersect the ray with every sphere in the block, writing the distance to each into the
+// given array and returning a bit mask of which were hit. This does exactly the arithmetic
+// of Sphere::collide() so that both always agree on the distance.
+inline int collideSpheres(const KDSphereBlock &b, const Ray &r, float *distances){
+#ifdef __SSE__
+    __m128 t_x = _mm_sub_ps(_mm_set1_ps(r.origin.x), _mm_loadu_ps(b.center_x)),
+           t_y = _mm_sub_ps(_mm_set1_ps(r.origin.y), _mm_loadu_ps(b.center_y)),
+           t_z = _mm_sub_ps(_mm_set1_ps(r.origin.z), _mm_loadu_ps(b.center_z));
+    __m128 dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(t_x, _mm_set1_ps(r.direction.x)),
+                                       _mm_mul_ps(t_y, _mm_set1_ps(r.direction.y))),
+                            _mm_mul_ps(t_z, _mm_set1_ps(r.direction.z)));
+    __m128 B = _mm_xor_ps(dot, _mm_set1_ps(-0.0f));
+    __m128 magnitude2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(t_x, t_x), _mm_mul_ps(t_y, t_y)), _mm_mul_ps(t_z, t_z));
+    __m128 rad = _mm_loadu_ps(b.radius);
+    __m128 D = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(B, B), magnitude2), _mm_mul_ps(rad, rad));
+    __m128 hit = _mm_cmpgt_ps(D, _mm_setzero_ps());
+
+    // Lanes that missed take the square root of a negative number, but they're masked off anyway.
+    D = _mm_sqrt_ps(D);
+    __m128 near = _mm_sub_ps(B, D);
+    __m128 use_far = _mm_cmplt_ps(near, _mm_setzero_ps());
+    __m128 distance = _mm_or_ps(_mm_and_ps(use_far, _mm_add_ps(B, D)), _mm_andnot_ps(use_far, near));
+    hit = _mm_and_ps(hit, _mm_cmpgt_ps(distance, _mm_setzero_ps()));
+
+    _mm_storeu_ps(distances, distance);
+    return _mm_movemask_ps(hit);
+#else
+    int hits = 0;
+    for (int i = 0; i < KD_BLOCK_SIZE; ++i){
+        Vec3 t = r.origin - Vec3(b.center_x[i], b.center_y[i], b.center_z[i]);
+        float B = -t.dot(r.direction);
+        float D = B * B - t.magnitude2() + b.radius[i] * b.radius[i];
+        if (D > 0){
+            D = sqrt(D);
+            distances[i] = B - D < 0 ? B + D : B - D;
+            if (distances[i] > 0){
+                hits |= 1 << i;
             }
         }
     }
-    children[RIGHT]->collide(r, c);
+    return hits;
+#endif
 }
 
-bool KDNode::collideOneChildBoolean(const Ray& r, const float d) const{
-    Vec3 high_mid_corner(high_corner);
-    high_mid_corner[axis] = partition_distance;
+// The prism counterpart of collideSpheres(), matching RectPrism::collide().
+inline int collidePrisms(const KDPrismBlock &b, const Ray &r, float *distances){
+    // Do backface culling if we aren't currently inside an object.
+    bool do_culling = r.inside_shape == NULL;
+#ifdef __SSE__
+    __m128 low[3] = {_mm_loadu_ps(b.low_x), _mm_loadu_ps(b.low_y), _mm_loadu_ps(b.low_z)},
+           high[3] = {_mm_loadu_ps(b.high_x), _mm_loadu_ps(b.high_y), _mm_loadu_ps(b.high_z)},
+           origin[3] = {_mm_set1_ps(r.origin.x), _mm_set1_ps(r.origin.y), _mm_set1_ps(r.origin.z)},
+           direction[3] = {_mm_set1_ps(r.direction.x), _mm_set1_ps(r.direction.y), _mm_set1_ps(r.direction.z)};
+    __m128 closest = _mm_set1_ps(numeric_limits<float>::infinity());
+
+    // See RectPrism::collide() for how each face is checked.
     for (int corner = 0; corner < 2; ++corner){
         for (int i = 0; i < 3; ++i){
-            if (r.direction[i] != 0){
-                float t = (corner == 0 ? high_mid_corner[i] - r.origin[i] : low_corner[i] - r.origin[i]) / r.direction[i];
+            if (r.direction[i] == 0 || (do_culling && (corner == 0 ? r.direction[i] > 0 : r.direction[i] < 0))){
+                continue;
+            }
+            __m128 t = _mm_div_ps(_mm_sub_ps(corner == 0 ? high[i] : low[i], origin[i]), direction[i]);
+            __m128 hit = _mm_and_ps(_mm_cmpge_ps(t, _mm_setzero_ps()), _mm_cmplt_ps(t, closest));
+            for (int j = 0; j < 3; ++j){
+                __m128 point = _mm_add_ps(origin[j], _mm_mul_ps(direction[j], t));
+                if (j == i){
+                    point = _mm_sub_ps(point, _mm_set1_ps((1 - 2 * corner) * EPSILON));
+                }
+                hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmple_ps(low[j], point), _mm_cmple_ps(point, high[j])));
+            }
+            closest = _mm_or_ps(_mm_and_ps(hit, t), _mm_andnot_ps(hit, closest));
+        }
+    }
+
+    _mm_storeu_ps(distances, closest);
+    return _mm_movemask_ps(_mm_cmplt_ps(closest, _mm_set1_ps(numeric_limits<float>::infinity())));
+#else
+    int hits = 0;
+    for (int lane = 0; lane < KD_BLOCK_SIZE; ++lane){
+        Vec3 low_corner(b.low_x[lane], b.low_y[lane], b.low_z[lane]),
+             high_corner(b.high_x[lane], b.high_y[lane], b.high_z[lane]);
+        for (int corner = 0; corner < 2; ++corner){
+            for (int i = 0; i < 3; ++i){
+                if (r.direction[i] == 0 || (do_culling && (corner == 0 ? r.direction[i] > 0 : r.direction[i] < 0))){
+                    continue;
+                }
+                float t = (corner == 0 ? high_corner[i] - r.origin[i] : low_corner[i] - r.origin[i]) / r.direction[i];
                 if (t < 0){
                     continue;
                 }
                 Vec3 point = r.pointAt(t);
                 point[i] -= (1 - 2 * corner) * EPSILON;
-                if (low_corner <= point && point <= high_mid_corner){
-                    // Collision with the left child.
-                    return children[LEFT]->collideBoolean(r, d);
+                if ((!(hits & (1 << lane)) || t < distances[lane]) && low_corner <= point && point <= high_corner){
+                    hits |= 1 << lane;
+                    distances[lane] = t;
                 }
             }
         }
     }
-    return children[RIGHT]->collideBoolean(r, d);
+    return hits;
+#endif
 }
 
-void KDNode::split(){
-    children[LEFT] = children[RIGHT] = NULL;
-    partition_distance = 0;
-    if (shapes.size() < KD_SPLIT_THRESHOLD){
-        axis = LEAF;
-        return;
-    }
-
-    Vec3 size = high_corner - low_corner;
-    float inv_surface_area_current = 0.5f / (size.x * size.y + size.y * size.z + size.z * size.x);
+bool KDTree::collideLeaf(const KDLeaf &leaf, const Ray &r, KDMailbox &mailbox, float &closest, uint32_t &closest_shape) const{
+    closest = numeric_limits<float>::infinity();
+    closest_shape = KD_NO_SHAPE;
+    float distances[KD_BLOCK_SIZE];
 
-    float best_partition_distances[3] = {0, 0, 0};
-    float best_costs[3] = {-1, -1, -1};
-    for (axis = 0; axis < 3; ++axis){
-        // Create the unique set of potential partitions that will be checked.
-        set<float> partition_set;
-        for (vector<Shape*>::iterator s_iter = shapes.begin(); s_iter != shapes.end(); ++s_iter){
-            partition_set.insert((*s_iter)->extremeValue(axis, EXTREME_VALUE_SMALLEST));
-            partition_set.insert((*s_iter)->extremeValue(axis, EXTREME_VALUE_LARGEST));
+    for (uint32_t b = leaf.first_sphere_block, remaining = leaf.num_spheres; remaining > 0; ++b){
+        uint32_t count = min<uint32_t>(remaining, KD_BLOCK_SIZE);
+        remaining -= count;
+        int lanes = mailbox.untested(sphere_blocks[b].shape, count);
+        if (lanes == 0){
+            continue;
         }
+        int hits = collideSpheres(sphere_blocks[b], r, distances) & lanes;
+        for (uint32_t lane = 0; hits != 0; ++lane, hits >>= 1){
+            if (hits & 1){
+                keepCloser(distances[lane], sphere_blocks[b].shape[lane], closest, closest_shape);
+            }
+        }
+    }
 
-        // Initialize the PartitionInfo structs.
-        float low_bound = low_corner[axis], high_bound = high_corner[axis];
-        vector<PartitionInfo> partitions;
-        for (set<float>::iterator p_iter = partition_set.begin(); p_iter != partition_set.end(); ++p_iter){
-            float current_partition_distance = *p_iter;
-            // Cut out any partitions that are beyond the range of this box.
-            if (current_partition_distance > low_bound && current_partition_distance < high_bound){
-                partitions.push_back(PartitionInfo(low_corner, high_corner, axis, current_partition_distance));
+    for (uint32_t b = leaf.first_prism_block, remaining = leaf.num_prisms; remaining > 0; ++b){
+        uint32_t count = min<uint32_t>(remaining, KD_BLOCK_SIZE);
+        remaining -= count;
+        int lanes = mailbox.untested(prism_blocks[b].shape, count);
+        if (lanes == 0){
+            continue;
+        }
+        int hits = collidePrisms(prism_blocks[b], r, distances) & lanes;
+        for (uint32_t lane = 0; hits != 0; ++lane, hits >>= 1){
+            if (hits & 1){
+                keepCloser(distances[lane], prism_blocks[b].shape[lane], closest, closest_shape);
             }
         }
-        
-        // Not sure when this actually happens, but it does...
-        if (partitions.empty()){
+    }
+
+    for (uint32_t i = leaf.first_shape, end = leaf.first_shape + leaf.num_shapes; i < end; ++i){
+        if (!mailbox.untested(leaf_shapes[i])){
             continue;
         }
+        Collision c = shapes[leaf_shapes[i]]->collide(r);
+        if (c.collided){
+            keepCloser(c.distance, leaf_shapes[i], closest, closest_shape);
+        }
+    }
+    return closest_shape != KD_NO_SHAPE;
+}
 
-        // Then sort them, quite literally, left to right to make the next step work.
-        sort(partitions.begin(), partitions.end());
+uint32_t KDTree::collideLeafBoolean(const KDLeaf &leaf, const Ray &r, KDMailbox &mailbox, const float d) const{
+    float distances[KD_BLOCK_SIZE];
 
-        // For each shape, make sure all the partitions know if it's on the right or left (or straddles and is on both).
-        int num_partitions = partitions.size();
-        for (vector<Shape*>::iterator s_iter = shapes.begin(); s_iter != shapes.end(); ++s_iter){
-            int last_left_index = binarySearchPartitions(partitions, (*s_iter)->extremeValue(axis, EXTREME_VALUE_SMALLEST)),
-                first_right_index = binarySearchPartitions(partitions, (*s_iter)->extremeValue(axis, EXTREME_VALUE_LARGEST));
-            for (int i = 0; i <= last_left_index; ++i){
-                partitions[i].count_right++;
-            }
-            for (int i = first_right_index; i < num_partitions; ++i){
-                partitions[i].count_left++;
-            }
-            for (int i = last_left_index + 1; i < first_right_index; ++i){
-                partitions[i].count_left++;
-                partitions[i].count_right++; 
-            }
+    for (uint32_t b = leaf.first_sphere_block, remaining = leaf.num_spheres; remaining > 0; ++b){
+        uint32_t count = min<uint32_t>(remaining, KD_BLOCK_SIZE);
+        remaining -= count;
+        int lanes = mailbox.untested(sphere_blocks[b].shape, count);
+        if (lanes == 0){
+            continue;
         }
-
-        // Find the best partition to use using the surface area heuristic.
-        for (vector<PartitionInfo>::iterator p_iter = partitions.begin(); p_iter != partitions.end(); ++p_iter){
-            PartitionInfo candidate = *p_iter;
-            // 1.5 is traversal cost, 1.0 is the cost of doing an intersection. Can be tweaked.
-            float cost = 2.5f + 0.9f * (candidate.surface_area_left * candidate.count_left * inv_surface_area_current +
-                                         candidate.surface_area_right * candidate.count_right * inv_surface_area_current);
-            if (best_costs[axis] == -1 || cost < best_costs[axis]){
-                best_partition_distances[axis] = candidate.partition_distance;
-                best_costs[axis] = cost;
+        int hits = collideSpheres(sphere_blocks[b], r, distances) & lanes;
+        for (uint32_t lane = 0; hits != 0; ++lane, hits >>= 1){
+            if ((hits & 1) && distances[lane] < d){
+                return sphere_blocks[b].shape[lane];
             }
         }
+    }
 
-        // And make sure it's worth using: this is the baseline cost the partitioning schemes must beat.
-        if (best_costs[axis] > 1.0f * shapes.size()){
-            best_costs[axis] = -1;
+    for (uint32_t b = leaf.first_prism_block, remaining = leaf.num_prisms; remaining > 0; ++b){
+        uint32_t count = min<uint32_t>(remaining, KD_BLOCK_SIZE);
+        remaining -= count;
+        int lanes = mailbox.untested(prism_blocks[b].shape, count);
+        if (lanes == 0){
             continue;
         }
+        int hits = collidePrisms(prism_blocks[b], r, distances) & lanes;
+        for (uint32_t lane = 0; hits != 0; ++lane, hits >>= 1){
+            if ((hits & 1) && distances[lane] < d){
+                return prism_blocks[b].shape[lane];
+            }
+        }
     }
 
-    // Figure out the axis with the best score.
-    axis = LEAF;
-    for (int i = 0; i < 3; ++i){
-        if (best_costs[i] != -1 && (axis == LEAF || best_costs[i] < best_costs[axis])){
-            axis = i;
+    for (uint32_t i = leaf.first_shape, end = leaf.first_shape + leaf.num_shapes; i < end; ++i){
+        if (!mailbox.untested(leaf_shapes[i])){
+            continue;
+        }
+        Collision c = shapes[leaf_shapes[i]]->collide(r);
+        if (c.collided && c.distance < d){
+            return leaf_shapes[i];
         }
     }
-    if (axis == LEAF){
+    return KD_NO_SHAPE;
+}
+
+void KDTree::collide(const Ray &r, Collision &c) const{
+    // Every push happens on the way down a single path, so the stack can never be deeper than the tree.
+    KDStackEntry stack[KD_MAX_DEPTH + 1];
+    int stack_size = 1;
+    stack[0].node = 0;
+    if (!clipToBounds(r, stack[0].t_min, stack[0].t_max)){
         return;
     }
 
-    // Member variable.
-    partition_distance = best_partition_distances[axis];
-    
-    Vec3 high_mid_corner = high_corner, low_mid_corner = low_corner;
-    high_mid_corner[axis] = low_mid_corner[axis] = partition_distance;
+    float closest = c.collided ? c.distance : numeric_limits<float>::infinity(), leaf_distance;
+    uint32_t closest_shape = KD_NO_SHAPE, leaf_shape;
+    KDMailbox mailbox;
+    while (stack_size > 0){
+        KDStackEntry current = stack[--stack_size];
+        // Nodes come off the stack front to back, so once the closest hit is nearer than where
+        // this node begins, nothing left on the stack can beat it.
+        if (closest < current.t_min){
+            break;
+        }
+        const KDFlatNode *leaf = descend(nodes, r, current, stack, stack_size);
 
-    // Assign all this node's shapes to either or both children.
-    vector<Shape*> left_shapes, right_shapes;
-    for (vector<Shape*>::iterator s_iter = shapes.begin(); s_iter != shapes.end(); ++s_iter){
-        Shape *s = *s_iter;
-        // if (s->collidesWithBox(low_corner, high_mid_corner)){
-        if (s->extremeValue(axis, EXTREME_VALUE_SMALLEST) < partition_distance){
-            left_shapes.push_back(s);
+        // objects_checked += leaf->numShapes();
+        if (collideLeaf(leaves[leaf->leaf], r, mailbox, leaf_distance, leaf_shape) && leaf_distance < closest){
+            closest = leaf_distance;
+            closest_shape = leaf_shape;
         }
-        // if (s->collidesWithBox(low_mid_corner, high_corner)){
-        if (s->extremeValue(axis, EXTREME_VALUE_LARGEST) > partition_distance){
-            right_shapes.push_back(s);
+
+        // A hit inside this leaf can't be beaten by anything farther along the ray. Hits beyond
+        // it (shapes straddling into later leaves) have to wait until those leaves are checked.
+        if (closest <= current.t_max){
+            break;
         }
     }
-    shapes.clear();
-    
-    children[LEFT] = new KDNode(left_shapes, low_corner, high_mid_corner);
-    children[RIGHT] = new KDNode(right_shapes, low_mid_corner, high_corner);
+
+    countShapeTests(mailbox);
+
+    // Only the closest hit needs a normal, so leave filling in the Collision to its shape.
+    if (closest_shape != KD_NO_SHAPE){
+        c = shapes[closest_shape]->collide(r);
+    }
 }
 
-void KDNode::calculateAggregateBounds(){
-    low_corner =  Vec3( numeric_limits<float>::infinity(),  numeric_limits<float>::infinity(),  numeric_limits<float>::infinity());
-    high_corner = Vec3(-numeric_limits<float>::infinity(), -numeric_limits<float>::infinity(), -numeric_limits<float>::infinity());
-    vector<Shape*>::const_iterator iter;
-    for (iter = shapes.begin(); iter != shapes.end(); ++iter){
-        Shape *s = *iter;
-        for (int i = 0; i < 3; ++i){
-            if (s->extremeValue(i, EXTREME_VALUE_SMALLEST) < low_corner[i]){
-                low_corner[i] = s->extremeValue(i, EXTREME_VALUE_SMALLEST);
+bool KDTree::collideBoolean(const Ray &r, const float d, const Shape *&occluder) const{
+    KDStackEntry stack[KD_MAX_DEPTH + 1];
+    int stack_size = 1;
+    stack[0].node = 0;
+    if (!clipToBounds(r, stack[0].t_min, stack[0].t_max)){
+        return false;
+    }
+    // Nothing past the given distance matters, so don't even traverse that part of the tree.
+    stack[0].t_max = min(stack[0].t_max, d);
+    if (stack[0].t_min > stack[0].t_max){
+        return false;
+    }
+
+    KDMailbox mailbox;
+    uint32_t hit = KD_NO_SHAPE;
+    while (stack_size > 0 && hit == KD_NO_SHAPE){
+        KDStackEntry current = stack[--stack_size];
+        const KDFlatNode *leaf = descend(nodes, r, current, stack, stack_size);
+
+        // objects_checked += leaf->numShapes();
+        hit = collideLeafBoolean(leaves[leaf->leaf], r, mailbox, d);
+    }
+    countShapeTests(mailbox);
+
+    if (hit == KD_NO_SHAPE){
+        return false;
+    }
+    occluder = shapes[hit];
+    return true;
+}
+
+#ifdef __SSE__
+
+// A node still waiting to be visited by a packet, along with the stretch of each ray
+// through it. Lanes where t_min > t_max don't pass through the node at all.
+struct KDPacketStackEntry{
+    uint32_t node;
+    __m128 t_min, t_max;
+};
+
+void KDTree::collidePacket(const Ray *rays, Collision *c) const{
+    // The rays can only share a walk down the tree if they all cross every splitting plane in
+    // the same direction, since that's what decides which child is near. Anything else (which
+    // is rare for rays through the same pixel) is traced one ray at a time.
+    bool negative[3];
+    for (int a = 0; a < 3; ++a){
+        negative[a] = rays[0].direction[a] < 0;
+        for (int i = 0; i < KD_PACKET_SIZE; ++i){
+            if (rays[i].direction[a] == 0 || (rays[i].direction[a] < 0) != negative[a]){
+                for (int j = 0; j < KD_PACKET_SIZE; ++j){
+                    collide(rays[j], c[j]);
+                }
+                return;
+            }
+        }
+    }
+
+    float t_min[KD_PACKET_SIZE], t_max[KD_PACKET_SIZE], closest[KD_PACKET_SIZE], leaf_distance;
+    uint32_t closest_shape[KD_PACKET_SIZE], leaf_shape;
+    KDMailbox mailboxes[KD_PACKET_SIZE];
+    // Lanes are done once they can't find anything closer, including if they miss the tree.
+    int done = 0;
+    for (int i = 0; i < KD_PACKET_SIZE; ++i){
+        if (!clipToBounds(rays[i], t_min[i], t_max[i])){
+            t_min[i] = 1;
+            t_max[i] = 0;
+            done |= 1 << i;
+        }
+        closest[i] = c[i].collided ? c[i].distance : numeric_limits<float>::infinity();
+        closest_shape[i] = KD_NO_SHAPE;
+    }
+    const int all_done = (1 << KD_PACKET_SIZE) - 1;
+    if (done == all_done){
+        return;
+    }
+
+    __m128 origin[3], inv_direction[3];
+    for (int a = 0; a < 3; ++a){
+        origin[a] = _mm_setr_ps(rays[0].origin[a], rays[1].origin[a], rays[2].origin[a], rays[3].origin[a]);
+        inv_direction[a] = _mm_setr_ps(1 / rays[0].direction[a], 1 / rays[1].direction[a],
+                                       1 / rays[2].direction[a], 1 / rays[3].direction[a]);
+    }
+
+    KDPacketStackEntry stack[KD_MAX_DEPTH + 1];
+    int stack_size = 1;
+    stack[0].node = 0;
+    stack[0].t_min = _mm_loadu_ps(t_min);
+    stack[0].t_max = _mm_loadu_ps(t_max);
+    __m128 closest_distance = _mm_loadu_ps(closest);
+
+    while (stack_size > 0){
+        KDPacketStackEntry current = stack[--stack_size];
+        const KDFlatNode *node = &nodes[current.node];
+        // Lanes whose closest hit is nearer than where the node begins have nothing to gain from it.
+        __m128 active = _mm_and_ps(_mm_cmple_ps(current.t_min, current.t_max),
+                                   _mm_cmple_ps(current.t_min, closest_distance));
+        if (_mm_movemask_ps(active) == 0){
+            continue;
+        }
+
+        while (!node->isLeaf()){
+            int axis = node->axis();
+            uint32_t near = node->children() + (negative[axis] ? RIGHT : LEFT),
+                     far = node->children() + (negative[axis] ? LEFT : RIGHT);
+            __m128 t = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node->partition_distance), origin[axis]), inv_direction[axis]);
+
+            // The same tests as descend(), but a child is visited if any active ray needs it.
+            int needs_near = _mm_movemask_ps(_mm_and_ps(active, _mm_cmpge_ps(t, current.t_min))),
+                needs_far = _mm_movemask_ps(_mm_and_ps(active, _mm_cmple_ps(t, current.t_max)));
+            if (!needs_far){
+                current.node = near;
+            }
+            else if (!needs_near){
+                current.node = far;
+                current.t_min = _mm_max_ps(current.t_min, t);
+            }
+            else{
+                KDPacketStackEntry &far_entry = stack[stack_size++];
+                far_entry.node = far;
+                far_entry.t_min = _mm_max_ps(current.t_min, t);
+                far_entry.t_max = current.t_max;
+
+                current.node = near;
+                current.t_max = _mm_min_ps(current.t_max, t);
+            }
+            active = _mm_and_ps(active, _mm_cmple_ps(current.t_min, current.t_max));
+            // kd_recurses++;
+            node = &nodes[current.node];
+        }
+
+        int lanes = _mm_movemask_ps(active);
+        _mm_storeu_ps(t_max, current.t_max);
+        for (int i = 0; i < KD_PACKET_SIZE; ++i){
+            if (!(lanes & (1 << i))){
+                continue;
+            }
+            // objects_checked += node->numShapes();
+            if (collideLeaf(leaves[node->leaf], rays[i], mailboxes[i], leaf_distance, leaf_shape) && leaf_distance < closest[i]){
+                closest[i] = leaf_distance;
+                closest_shape[i] = leaf_shape;
             }
-            if (s->extremeValue(i, EXTREME_VALUE_LARGEST) > high_corner[i]){
-                high_corner[i] = s->extremeValue(i, EXTREME_VALUE_LARGEST);
+            // As in collide(), a hit inside this leaf can't be beaten by anything farther along.
+            if (closest[i] <= t_max[i]){
+                done |= 1 << i;
             }
         }
+        if (done == all_done){
+            break;
+        }
+        closest_distance = _mm_loadu_ps(closest);
+    }
+
+    for (int i = 0; i < KD_PACKET_SIZE; ++i){
+        countShapeTests(mailboxes[i]);
+        if (closest_shape[i] != KD_NO_SHAPE){
+            c[i] = shapes[closest_shape[i]]->collide(rays[i]);
+        }
     }
 }
+
+#else
+
+void KDTree::collidePacket(const Ray *rays, Collision *c) const{
+    for (int i = 0; i < KD_PACKET_SIZE; ++i){
+        collide(rays[i], c[i]);
+    }
+}
+
+#endif
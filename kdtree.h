@@ -2,53 +2,138 @@
 #define KDTREE_H
 
 #include "constants.h"
-#include "shapes.h"
 
-// Needs a destructor.
+#include "shapes.h"
 
 // The smallest number of shapes a node can hold before it's a candidate for splitting.
 const unsigned int KD_SPLIT_THRESHOLD = 4;
 
+// The deepest a kd-tree is allowed to grow. This bounds the size of the traversal stack.
+const int KD_MAX_DEPTH = 48;
+
+// The most bins per axis a binned build can use.
+const int KD_MAX_BINS = 256;
+
+// Subtrees with fewer shapes than this are always built on the thread that split their parent,
+// since starting a new thread for them would take longer than building them.
+const unsigned int KD_PARALLEL_THRESHOLD = 2048;
+
+// How many rays KDTree::collidePacket() traces at once: one per lane of an SSE register.
+const int KD_PACKET_SIZE = 4;
+
+// How many shapes of one type a leaf stores together, to be intersected with a ray at once.
+const int KD_BLOCK_SIZE = 4;
+
+// How many shapes a KDMailbox remembers. Must be a power of two.
+const int KD_MAILBOX_SIZE = 16;
+
+// Debugging flag -- count how many shapes rays are intersected with and how many repeated
+// intersections mailboxing saves, so they can be printed after rendering.
+const bool KD_COUNT_SHAPE_TESTS = false;
+
+// Marks the absence of a shape wherever shapes are identified by their index.
+const uint32_t KD_NO_SHAPE = 0xFFFFFFFF;
+
+// Types of KDEvents, in the order they are sorted when they fall at the same position.
+enum {KD_EVENT_END = 0, KD_EVENT_PLANAR = 1, KD_EVENT_START = 2};
+
+// A candidate splitting plane used while building the kd-tree: the place along one axis
+// where a shape's bounds begin or end (or both, for shapes that are flat along that axis).
+// Each node keeps the events of all its shapes sorted, so split candidates are found by
+// sweeping instead of searching, and children inherit the order without re-sorting.
+struct KDEvent{
+    KDEvent() {}
+    KDEvent(const float position, const uint32_t shape, const uint8_t axis, const uint8_t type) : position(position),
+                                                                                                    shape(shape),
+                                                                                                    axis(axis),
+                                                                                                    type(type) {}
+
+    bool operator<(const KDEvent& other) const{
+        if (axis != other.axis){
+            return axis < other.axis;
+        }
+        if (position != other.position){
+            return position < other.position;
+        }
+        if (type != other.type){
+            return type < other.type;
+        }
+        // Not needed for correctness, but it makes the tree the same however the events get sorted.
+        return shape < other.shape;
+    }
+
+    float position;
+
+    // Index of the shape this event belongs to, in the list given to the root KDNode.
+    uint32_t shape;
+
+    uint8_t axis, type;
+};
+
+// The bounds of every shape in the scene, looked up by shape index during a binned build.
+// Shared read-only by every node (and thread) of the build.
+struct KDShapeBounds{
+    vector<Vec3> low_corners, high_corners;
+
+    // How many equal-width bins each axis of a node is divided into.
+    int bins;
+};
+
+// A node of the kd-tree used only while building it. Once the tree is built, it is
+// compiled into the flat array of a KDTree and then thrown away.
 class KDNode{
  public:
-    // Required by the serialization library indirectly through Raytracer.
-    KDNode() {}
-
     // Create a new kd-tree with the given list of Shapes, that assigns itself
     // a volume large enough to surround the given shapes. It automatically
-    // begins the splitting process.
-    KDNode(const vector<Shape*>&);
-
-    // Create a child node with the given low and high corners that
-    // automatically begins the splitting process.
-    KDNode(const vector<Shape*>&, const Vec3&, const Vec3&);
+    // begins the splitting process, using up to the given number of threads.
+    // If the number of bins is positive, split candidates are limited to the
+    // boundaries of that many equal-width bins per axis, which is much faster to
+    // build but slightly slower to traverse. Otherwise every candidate is evaluated.
+    KDNode(const vector<Shape*>&, const int, const int);
 
-    // Collide the ray with the KDNode. If this is a leaf node, collide the ray with the
-    // objects and update the given Collision if appropriate. Otherwise, delegate the
-    // colliding to the children nodes.
-    void collide(const Ray&, Collision&) const;
-
-    // Return true if the ray hits an object within the given distance for the given ray
-    // using the same algorithm as the normal collide function, but terminating as early
-    // as possible.
-    bool collideBoolean(const Ray&, const float) const;
+    ~KDNode();
 
     // Print out this KDNode and all its children.
     void print(const int) const;
 
  private:
-    // Called by collide() when it knows the ray in question only hits one of the children.
-    void collideOneChild(const Ray&, Collision&) const;
+    // Create a child node with the given sorted events, number of shapes, low and high
+    // corners, depth and number of threads that automatically begins the splitting process.
+    // The events are consumed. The last argument is scratch space with one entry per shape
+    // in the scene, which must not be shared with any other thread.
+    KDNode(vector<KDEvent>&, const unsigned int, const Vec3&, const Vec3&, const int, const int, vector<uint8_t>&);
+
+    // Create a child node in a binned build with the given shapes (which are consumed),
+    // bounds of all shapes, low and high corners, depth and number of threads that
+    // automatically begins the splitting process.
+    KDNode(vector<uint32_t>&, const KDShapeBounds&, const Vec3&, const Vec3&, const int, const int);
 
-    // Corresponding collideOneChild, but for collideBoolean.
-    bool collideOneChildBoolean(const Ray&, const float) const;
+    // Not copyable: each node owns its children.
+    KDNode(const KDNode&);
+    KDNode& operator=(const KDNode&);
 
     // Split this KDNode into 2 new children, populate them, then ask them to
     // split if appropriate.
-    void split();
+    void split(vector<KDEvent>&, const unsigned int, const int, const int, vector<uint8_t>&);
+
+    // Sweep over the events to find the cheapest split according to the surface area
+    // heuristic, returning false if no split is cheaper than leaving this as a leaf.
+    // Each axis is swept on its own thread if there are enough threads to go around.
+    bool findSplit(const vector<KDEvent>&, const unsigned int, const int, int&, float&) const;
+
+    // Sweep over the events of a single axis, lowering the given cost and moving the
+    // given distance if any split along the axis is cheaper.
+    void sweepAxis(vector<KDEvent>::const_iterator, vector<KDEvent>::const_iterator, const unsigned int, float*, float*) const;
+
+    // The binned counterpart of split(), working on this node's list of shapes directly.
+    void splitBinned(const KDShapeBounds&, const int, const int);
+
+    // The binned counterpart of findSplit(): count the shapes starting and ending in each
+    // bin and only consider splits on the boundaries between bins.
+    bool findBinnedSplit(const KDShapeBounds&, int&, float&) const;
 
-    // Set the bounds of this node to surround all the contained shapes.
-    void calculateAggregateBounds();
+    // Set the bounds of this node to surround all the given shapes.
+    void calculateAggregateBounds(const vector<Shape*>&);
 
     // The bounds of this node. low_corner < high_corner for all elements.
     Vec3 low_corner, high_corner;
@@ -62,20 +147,249 @@ class KDNode{
     // The children of this node, if they exist.
     KDNode *children[2];
 
-    // What shapes this leaf node contains.
+    // What shapes this leaf node contains, as indices into the list given to the root.
+    vector<uint32_t> shapes;
+
+    friend class KDTree;
+    friend struct KDBuildTask;
+    friend struct KDBinnedBuildTask;
+};
+
+// One node of a compiled KDTree. Interior nodes hold the splitting plane and the index
+// of their children, which are always adjacent in the node array (left, then right).
+// Leaves hold a range of the tree's shared shape index array.
+struct KDFlatNode{
+    union{
+        // Interior nodes: the location of the splitting plane along axis().
+        float partition_distance;
+
+        // Leaves: the index of this leaf's contents in KDTree::leaves.
+        uint32_t leaf;
+    };
+
+    // The low two bits are the axis (or LEAF), the rest are either the index of the left
+    // child or the number of shapes in the leaf.
+    uint32_t flags;
+
+    inline int axis() const { return flags & 3; }
+    inline bool isLeaf() const { return (flags & 3) == LEAF; }
+    inline uint32_t children() const { return flags >> 2; }
+    inline uint32_t numShapes() const { return flags >> 2; }
+
+ private:
+    friend class boost::serialization::access;
+
+    // The union is archived through its integer member so the float survives the
+    // text archive bit for bit.
+    template<class Archive>
+    void serialize(Archive &ar, const unsigned int version){
+        ar & leaf;
+        ar & flags;
+    }
+};
+
+// Up to KD_BLOCK_SIZE spheres from one leaf, stored as a structure of arrays so they can
+// all be intersected with a ray at once. A block is only partly used if its leaf's spheres
+// don't fill it.
+struct KDSphereBlock{
+    float center_x[KD_BLOCK_SIZE], center_y[KD_BLOCK_SIZE], center_z[KD_BLOCK_SIZE], radius[KD_BLOCK_SIZE];
+
+    // Indices into KDTree::shapes.
+    uint32_t shape[KD_BLOCK_SIZE];
+
+ private:
+    friend class boost::serialization::access;
+
+    template<class Archive>
+    void serialize(Archive &ar, const unsigned int version){
+        ar & center_x;
+        ar & center_y;
+        ar & center_z;
+        ar & radius;
+        ar & shape;
+    }
+};
+
+// The rectangular prism counterpart of KDSphereBlock.
+struct KDPrismBlock{
+    float low_x[KD_BLOCK_SIZE], low_y[KD_BLOCK_SIZE], low_z[KD_BLOCK_SIZE],
+          high_x[KD_BLOCK_SIZE], high_y[KD_BLOCK_SIZE], high_z[KD_BLOCK_SIZE];
+
+    // Indices into KDTree::shapes.
+    uint32_t shape[KD_BLOCK_SIZE];
+
+ private:
+    friend class boost::serialization::access;
+
+    template<class Archive>
+    void serialize(Archive &ar, const unsigned int version){
+        ar & low_x;
+        ar & low_y;
+        ar & low_z;
+        ar & high_x;
+        ar & high_y;
+        ar & high_z;
+        ar & shape;
+    }
+};
+
+// The contents of one leaf, split up by type. Spheres and prisms are kept in blocks so
+// they can be intersected without virtual calls; any other shape goes through Shape::collide.
+struct KDLeaf{
+    // The first of this leaf's blocks in KDTree::sphere_blocks, and how many spheres it has.
+    uint32_t first_sphere_block, num_spheres;
+
+    // The first of this leaf's blocks in KDTree::prism_blocks, and how many prisms it has.
+    uint32_t first_prism_block, num_prisms;
+
+    // Where this leaf's other shapes begin in KDTree::leaf_shapes, and how many there are.
+    uint32_t first_shape, num_shapes;
+
+ private:
+    friend class boost::serialization::access;
+
+    template<class Archive>
+    void serialize(Archive &ar, const unsigned int version){
+        ar & first_sphere_block;
+        ar & num_spheres;
+        ar & first_prism_block;
+        ar & num_prisms;
+        ar & first_shape;
+        ar & num_shapes;
+    }
+};
+
+// Remembers which shapes one ray has already been intersected with, so that shapes
+// straddling several leaves are only intersected once. Shapes are filed by their index
+// modulo the size, so two shapes can push each other out, costing a repeated
+// intersection but never a wrong answer. The result of the first intersection never
+// needs to be remembered: if it hit, it was already considered for the closest hit.
+struct KDMailbox{
+    KDMailbox() : tests(0), skipped(0){
+        for (int i = 0; i < KD_MAILBOX_SIZE; ++i){
+            shapes[i] = KD_NO_SHAPE;
+        }
+    }
+
+    // Return true if the ray hasn't been intersected with the given shape yet, and
+    // remember that it now has been.
+    inline bool untested(const uint32_t shape){
+        uint32_t &slot = shapes[shape & (KD_MAILBOX_SIZE - 1)];
+        bool result = slot != shape;
+        slot = shape;
+        if (KD_COUNT_SHAPE_TESTS){
+            ++(result ? tests : skipped);
+        }
+        return result;
+    }
+
+    // The same for the first count of the given shapes, returning a bit mask of which of
+    // them haven't been intersected yet.
+    inline int untested(const uint32_t *s, const uint32_t count){
+        int lanes = 0;
+        for (uint32_t i = 0; i < count; ++i){
+            lanes |= untested(s[i]) << i;
+        }
+        return lanes;
+    }
+
+    uint32_t shapes[KD_MAILBOX_SIZE];
+
+    // How many shapes were intersected and how many were skipped. Only counted if
+    // KD_COUNT_SHAPE_TESTS is set.
+    unsigned long tests, skipped;
+};
+
+// A kd-tree over all the shapes in the scene, stored as one contiguous array of
+// compact nodes and traversed iteratively.
+class KDTree{
+ public:
+    // Required by the serialization library indirectly through Raytracer.
+    KDTree() {}
+
+    // Build a kd-tree over the given shapes using up to the given number of threads and
+    // the given number of bins (see KDNode), and compile it into flat form.
+    KDTree(const vector<Shape*>&, const int, const int);
+
+    // Collide the ray with the tree, updating the given Collision if a closer hit is
+    // found in any of the leaves the ray passes through. Leaves are visited front to
+    // back, stopping at the first one that contains a hit.
+    void collide(const Ray&, Collision&) const;
+
+    // Return true if the ray hits an object within the given distance for the given ray
+    // using the same algorithm as the normal collide function, but terminating as early
+    // as possible. The object that was hit is stored in the given shape pointer, which
+    // is left alone if nothing was hit.
+    bool collideBoolean(const Ray&, const float, const Shape*&) const;
+
+    // Collide KD_PACKET_SIZE rays with the tree at once, giving the same results as calling
+    // collide() on each. Coherent rays (such as the samples of one pixel) share their walk
+    // down the tree, with the planes of each node tested against all of them in parallel.
+    // Falls back to one ray at a time if the rays aren't all headed the same way.
+    void collidePacket(const Ray*, Collision*) const;
+
+    // A short description of the size of the tree, for reporting after it's built.
+    string statistics() const;
+
+    // A short description of how many shapes all rays so far were intersected with, for
+    // reporting after rendering. Only meaningful if KD_COUNT_SHAPE_TESTS is set.
+    static string shapeTestStatistics();
+
+ private:
+    // Append the given built node and all its children into the node array. The
+    // slot for the node itself must already exist at the given index.
+    void compile(const KDNode*, const uint32_t);
+
+    // Clip the ray to the bounds of the whole tree, setting up the root traversal entry.
+    // Returns false if the ray misses the tree entirely.
+    bool clipToBounds(const Ray&, float&, float&) const;
+
+    // Find the closest hit in the given leaf, setting its distance and its index into shapes
+    // and returning true if there is one. Ties go to the shape listed first in the scene.
+    // Only the distance is found; the rest of the Collision is left to the shape itself.
+    // Shapes already in the mailbox are skipped, and every other one is added to it.
+    bool collideLeaf(const KDLeaf&, const Ray&, KDMailbox&, float&, uint32_t&) const;
+
+    // Return the index into shapes of something in the given leaf that is hit within the
+    // given distance, or KD_NO_SHAPE if there isn't anything.
+    uint32_t collideLeafBoolean(const KDLeaf&, const Ray&, KDMailbox&, const float) const;
+
+    // Add the counts of a finished ray's mailbox to the totals, if they're being kept.
+    static void countShapeTests(const KDMailbox&);
+
+    // The bounds of the whole tree, padded by EPSILON.
+    Vec3 low_corner, high_corner;
+
+    // All the nodes of the tree. The root is at index 0.
+    vector<KDFlatNode> nodes;
+
+    // The contents of every leaf.
+    vector<KDLeaf> leaves;
+
+    // The spheres and prisms of each leaf, one leaf after another.
+    vector<KDSphereBlock> sphere_blocks;
+    vector<KDPrismBlock> prism_blocks;
+
+    // The indices (into shapes) of the shapes in each leaf that aren't spheres or prisms,
+    // one leaf after another.
+    vector<uint32_t> leaf_shapes;
+
+    // Every shape in the tree, each listed exactly once.
     vector<Shape*> shapes;
 
     friend class boost::serialization::access;
-    
+
     template<class Archive>
     void serialize(Archive &ar, const unsigned int version){
         ar & low_corner;
         ar & high_corner;
-        ar & partition_distance;
-        ar & axis;
+        ar & nodes;
+        ar & leaves;
+        ar & sphere_blocks;
+        ar & prism_blocks;
+        ar & leaf_shapes;
         ar & shapes;
-        ar & children;
-    } 
+    }
 };
 
 #endif
@@ -18,20 +18,13 @@ void Light::setArea(const float side_length, const int samples){
     }
 }
 
-vector<Vec3> Light::samplePoints(CRandomMersenne& twister) const{
-    vector<Vec3> points;
+Vec3 Light::samplePoint(const int i, CRandomMersenne& twister) const{
     if (!area_light){
-        points.push_back(pos);
-        return points;
-    }
-    
-    for (int x = 0; x < samples; ++x){
-        for (int z = 0; z < samples; ++z){
-            points.push_back(corner + x_vec * (x + (float) twister.Random()) + z_vec * (z + (float) twister.Random()));
-        }
+        return pos;
     }
 
-    return points;
+    int x = i / samples, z = i % samples;
+    return corner + x_vec * (x + (float) twister.Random()) + z_vec * (z + (float) twister.Random());
 }
 
 float Light::collide(const Ray &r) const{
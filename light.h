@@ -24,10 +24,14 @@ class Light{
     // light if the position is ever modified to update the area-light-specific information.
     void setArea(const float, const int);
 
-    // Get the set of sample points, generated anew every time, of this light source. They
-    // are generated by diving the area into a square grid and generating a sample point
-    // at a random point inside each grid square.
-    vector<Vec3> samplePoints(CRandomMersenne&) const;
+    // How many sample points this light source has: one for a point light, or one for each
+    // square of the grid an area light is divided into.
+    inline int numSamples() const { return area_light ? samples * samples : 1; }
+
+    // Generate the given sample point (from 0 to numSamples() - 1) anew: a random point
+    // inside that square of the grid, or the position of a point light. Generating them one
+    // at a time as they're needed means shading never has to allocate room for them.
+    Vec3 samplePoint(const int, CRandomMersenne&) const;
 
     // Returns -1 if the given ray doesn't collide with this light, and a t-value otherwise.
     // Point lights always return -1.
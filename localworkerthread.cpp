@@ -1,45 +1,90 @@
 #include "localworkerthread.h"
 
-LocalWorkerThread::LocalWorkerThread(const Raytracer &r, ThreadInfo &ti) : raytracer(r), info(ti){
-    for (unsigned int i = 0; i < info.columns.size(); ++i){
-        info.pixels.push_back(vector<Vec3>());
+TileScheduler::TileScheduler(const int resx, const int resy, const int threads){
+    tiles_x = (resx + TILE_SIDE_LENGTH - 1) / TILE_SIDE_LENGTH;
+    int tiles_y = (resy + TILE_SIDE_LENGTH - 1) / TILE_SIDE_LENGTH;
+    int num_tiles = tiles_x * tiles_y;
+
+    // Contiguous runs keep each thread's tiles near each other, and its stolen tiles come from
+    // the far end of another thread's run.
+    for (int t = 0; t < threads; ++t){
+        queues.push_back(new TileQueue());
+        for (int i = num_tiles * t / threads; i < num_tiles * (t + 1) / threads; ++i){
+            queues.back()->tiles.push_back(i);
+        }
     }
 }
 
-void LocalWorkerThread::operator()(){
-    CRandomMersenne twister(time(NULL));
+TileScheduler::~TileScheduler(){
+    for (unsigned int i = 0; i < queues.size(); ++i){
+        delete queues[i];
+    }
+}
 
-    int resy = raytracer.getY();
-    for (unsigned int i = 0; i < info.columns.size(); ++i){
-        for (int y = 0; y < resy; ++y){
-            info.pixels[i].push_back(raytracer.colorTrace(info.columns[i], y, twister));
+bool TileScheduler::next(const int thread, int &tile){
+    {
+        TileQueue &own = *queues[thread];
+        boost::mutex::scoped_lock lock(own.mutex);
+        if (!own.tiles.empty()){
+            tile = own.tiles.front();
+            own.tiles.pop_front();
+            return true;
         }
     }
-}
 
-// Tiling version. Maybe this will be useful again sometime...?
-/*
-LocalWorkerThread::LocalWorkerThread(const Raytracer &r, ThreadInfo &ti) : raytracer(r), info(ti){
-    for (unsigned int i = 0; i < info.tiles.size(); ++i){
-        info.pixels.push_back(vector<Vec3>());
+    // Tiles are never added, so once every queue has been seen empty there's nothing left.
+    for (unsigned int i = 1; i < queues.size(); ++i){
+        TileQueue &victim = *queues[(thread + i) % queues.size()];
+        boost::mutex::scoped_lock lock(victim.mutex);
+        if (!victim.tiles.empty()){
+            tile = victim.tiles.back();
+            victim.tiles.pop_back();
+            return true;
+        }
     }
+    return false;
 }
 
+LocalWorkerThread::LocalWorkerThread(const Raytracer &r, TileScheduler &s, const int t, vector<Color> &i, const bool w) :
+    raytracer(r), scheduler(s), thread(t), image(i), wavefront(w) {}
+
 void LocalWorkerThread::operator()(){
-    srand(time(NULL));
+    CRandomMersenne twister(time(NULL));
+    ShadowCache shadow_cache;
+    WavefrontState wavefront_state;
 
     int resx = raytracer.getX(), resy = raytracer.getY();
-    int tiles_x = ceil(((float) resx) / TILE_SIDE_LENGTH),
-        tiles_y = ceil(((float) resy) / TILE_SIDE_LENGTH);
-
-    for (unsigned int i = 0; i < info.tiles.size(); ++i){
-        int x_max = (info.tiles[i] % tiles_x + 1) * TILE_SIDE_LENGTH,
-            y_max = (info.tiles[i] / tiles_y + 1) * TILE_SIDE_LENGTH; // This works because of integer division.
-        for (int x = x_max - TILE_SIDE_LENGTH; x < x_max && x < resx; ++x){
-            for (int y = y_max - TILE_SIDE_LENGTH; y < y_max && y < resy; ++y){
-                info.pixels[i].push_back(raytracer.colorTrace(x, y));
+    pair<int, int> pixels[TILE_SIDE_LENGTH * TILE_SIDE_LENGTH];
+    Color colors[TILE_SIDE_LENGTH * TILE_SIDE_LENGTH];
+    int tile;
+    while (scheduler.next(thread, tile)){
+        int x_min = (tile % scheduler.tilesX()) * TILE_SIDE_LENGTH,
+            y_min = (tile / scheduler.tilesX()) * TILE_SIDE_LENGTH;
+
+        // Go through the tile in Z-order, so that consecutive pixels are always close together
+        // and their rays tend to visit the same parts of the scene.
+        int num_pixels = 0;
+        for (int i = 0; i < TILE_SIDE_LENGTH * TILE_SIDE_LENGTH; ++i){
+            int x = x_min, y = y_min;
+            for (int bit = 0; (1 << bit) < TILE_SIDE_LENGTH; ++bit){
+                x += ((i >> (2 * bit)) & 1) << bit;
+                y += ((i >> (2 * bit + 1)) & 1) << bit;
+            }
+            if (x < resx && y < resy){
+                pixels[num_pixels++] = make_pair(x, y);
+            }
+        }
+
+        if (wavefront){
+            raytracer.wavefrontTrace(pixels, num_pixels, twister, shadow_cache, wavefront_state, colors);
+        }
+        else{
+            for (int i = 0; i < num_pixels; ++i){
+                colors[i] = raytracer.colorTrace(pixels[i].first, pixels[i].second, twister, shadow_cache);
             }
         }
+        for (int i = 0; i < num_pixels; ++i){
+            image[pixels[i].first * resy + pixels[i].second] = colors[i];
+        }
     }
 }
-*/
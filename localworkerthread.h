@@ -1,34 +1,61 @@
 #ifndef LOCALWORKERTHREAD_H
 #define LOCALWORKERTHREAD_H
 
+#include <deque>
 #include <vector>
+#include <boost/thread/mutex.hpp>
+#include <boost/utility.hpp>
 
 #include "constants.h"
 #include "vec3.h"
 #include "raytracer.h"
 
-struct ThreadInfo{
-    // Which columns this thread is to compute.
-    vector<int> columns;
-    // Use this when doing the tiling version...
-    // vector<int> tiles;
-    
-    // Resultant pixel tiles. The contents of this aren't guaranteed 
-    // to be complete until the thread terminates.
-    vector<vector<Vec3> > pixels; 
+// Hands out the tiles of an image to worker threads. Each thread starts with a contiguous
+// run of tiles of its own and takes them from the front; once they run out it steals from
+// the back of another thread's, so no thread sits idle while there's work left anywhere.
+class TileScheduler : boost::noncopyable{
+ public:
+    // Split an image of the given resolution into tiles for the given number of threads.
+    TileScheduler(const int, const int, const int);
+
+    ~TileScheduler();
+
+    // Get the next tile for the given thread into the given int, returning false when every
+    // tile has been handed out.
+    bool next(const int, int&);
+
+    // The number of tiles across the image.
+    inline int tilesX() const { return tiles_x; }
+
+ private:
+    // One thread's remaining tiles, and the lock for taking one.
+    struct TileQueue{
+        deque<int> tiles;
+        boost::mutex mutex;
+    };
+
+    int tiles_x;
+
+    // Allocated once, since mutexes can't be copied.
+    vector<TileQueue*> queues;
 };
 
 class LocalWorkerThread{
  public:
-    LocalWorkerThread(const Raytracer&, ThreadInfo&);
+    // Trace tiles from the given scheduler as the given thread, into the given image (indexed
+    // by x * resy + y), a bounce at a time if the given bool is set.
+    LocalWorkerThread(const Raytracer&, TileScheduler&, const int, vector<Color>&, const bool);
 
-    // Do all assigned work. Modifying the contents of the threadinfo
-    // class while this thread is running is undefined behavior.
-    void operator()(); 
+    // Trace tiles until there are none left. Each pixel of the image is written by exactly
+    // one thread, so the image is complete once every thread has finished.
+    void operator()();
 
  private:
     const Raytracer &raytracer;
-    ThreadInfo &info;
+    TileScheduler &scheduler;
+    int thread;
+    vector<Color> &image;
+    bool wavefront;
 };
 
 #endif
@@ -17,19 +17,52 @@
 
 // extern long objects_checked, kd_recurses;
 
+#ifdef HAVE_PNGWRITER
+// Write the given image, indexed by x * resy + y, to the given PNG file.
+void writeImage(const vector<Color> &image, const int resx, const int resy, const string &filename){
+    cout << "Writing image to file... ";
+    cout.flush();
+    pngwriter img = pngwriter(resx, resy, 1.0, filename.c_str());
+    img.setcompressionlevel(9);
+    for (int x = 0; x < resx; ++x){
+        for (int y = 0; y < resy; ++y){
+            const Color &pixel = image[x * resy + y];
+            img.plot(x + 1, y + 1, pixel[0], pixel[1], pixel[2]);
+        }
+    }
+    img.close();
+    cout << "done" << endl;
+}
+#endif
+
 int main(int argc, char *argv[]){
     if (argc < 2){
         cout << "To raytrace locally: " << argv[0] << " <filename>" << endl;
         cout << "To run a server: " << argv[0] << " -s <filename>" << endl;
         cout << "To run a client: " << argv[0] << " -c <host>" << endl;
         cout << "If unsupplied, port defaults to " << DEFAULT_PORT << "." << endl;
+        cout << "Use -t <threads> to set the number of threads (default " << ((int) DEFAULT_THREADS) << ")." << endl;
+        cout << "Use -b <bins> to build the kd-tree faster but less exactly, with that many bins per axis." << endl;
+        cout << "Use -a bvh to find collisions with a bounding volume hierarchy instead of a kd-tree." << endl;
+        cout << "Use -i to precompute irradiance from the global photon map instead of gathering photons while shading." << endl;
+        cout << "Use -g to light diffuse surfaces by final gathering from the photon maps, through an irradiance cache." << endl;
+        cout << "Use -P <passes> to fire the scene's photons that many times over with progressive photon mapping," << endl
+             << "    writing the image after every pass." << endl;
+        cout << "Use -C <directory> to keep photon maps there and reuse them for runs of the same scene and photon count." << endl;
+        cout << "Use -A to antialias adaptively, tracing every sample only in pixels whose first few samples differ." << endl;
+        cout << "Use -R to trace a random few of the reflections and refractions too faint to matter, rather than none." << endl;
+        cout << "Use -W to render tiles a bounce at a time, sorting each bounce's rays to be coherent (every antialiasing" << endl
+             << "    sample is traced, even with -A)." << endl;
         exit(EXIT_SUCCESS);
     }
 
     string host_ip, port = DEFAULT_PORT, filename;
-    uint8_t num_threads = DEFAULT_THREADS;
+    RenderOptions options;
 
-    switch (processArguments(argc, argv, host_ip, port, filename, num_threads)){
+    int program_type = processArguments(argc, argv, host_ip, port, filename, options);
+    uint8_t num_threads = options.threads;
+
+    switch (program_type){
     case LOCAL:
         { // Braces are required because variables are declared in this block. The braces scope the variables so that
           // other cases do not see them.
@@ -47,7 +80,7 @@ int main(int argc, char *argv[]){
             }
             string composite_image_name = filename + ".png";
 
-            Raytracer raytracer = processInput(input);
+            Raytracer raytracer = processInput(input, options);
             input.close();
 
             int resx = raytracer.getX(), resy = raytracer.getY();
@@ -56,23 +89,12 @@ int main(int argc, char *argv[]){
                 " image with " << ((int) num_threads) << " threads... ";
             cout.flush();
  
-            ThreadInfo thread_infos[num_threads];
-            for (int i = 0; i < resx; ++i){
-                thread_infos[i % num_threads].columns.push_back(i);
-            }
-            // Divide work by tiles.
-            /*
-            int tiles_x = ceil(((float) resx) / TILE_SIDE_LENGTH),
-                tiles_y = ceil(((float) resy) / TILE_SIDE_LENGTH);
-            for (int i = 0; i < tiles_x * tiles_y; ++i){
-                thread_infos[i % num_threads].tiles.push_back(i);
-            }
-            */
-        
-            // Split up work among the appropriate number of threads.
+            // Every thread writes its own pixels straight into the image.
+            vector<Color> image(resx * resy);
+            TileScheduler scheduler(resx, resy, num_threads);
             boost::thread_group worker_threads;
             for (int i = 0; i < num_threads; ++i){
-                boost::thread *thread = new boost::thread(LocalWorkerThread(raytracer, thread_infos[i]));
+                boost::thread *thread = new boost::thread(LocalWorkerThread(raytracer, scheduler, i, image, options.wavefront));
                 worker_threads.add_thread(thread);
             }
     
@@ -80,49 +102,43 @@ int main(int argc, char *argv[]){
 
             cout << "done" << endl;
 
+            if (KD_COUNT_SHAPE_TESTS){
+                cerr << KDTree::shapeTestStatistics() << endl;
+            }
+
             /*
             cerr << (resx * resy) << " pixels" << endl;
             cerr << objects_checked << " objects checked: " << (1.0 * objects_checked / (resx * resy)) << " per pixel" << endl;
             cerr << kd_recurses << " kd recurses: " << (1.0 * kd_recurses / (resx * resy)) << " per pixel" << endl;
             */
 
-            cout << "Writing image to file... ";
-            cout.flush();
-            pngwriter img = pngwriter(resx, resy, 1.0, composite_image_name.c_str());
-            img.setcompressionlevel(9);
-
-            // Consolidate tiled pixel data into an image.
-            /*
-            for (int t = 0; t < num_threads; ++t){
-                ThreadInfo ti = thread_infos[t];
-                for (unsigned int i = 0; i < ti.tiles.size(); ++i){
-                    // C'n'p from localworkerthread.cpp.
-                    int x_max = (ti.tiles[i] % tiles_x + 1) * TILE_SIDE_LENGTH,
-                        y_max = (ti.tiles[i] / tiles_y + 1) * TILE_SIDE_LENGTH;
-                    int pixel_index = 0;
-                    for (int x = x_max - TILE_SIDE_LENGTH; x < x_max && x < resx; ++x){
-                        for (int y = y_max - TILE_SIDE_LENGTH; y < y_max && y < resy; ++y){
-                            Vec3 pixel = ti.pixels[i][pixel_index++];
-                            img.plot(x + 1, y + 1, pixel[0], pixel[1], pixel[2]);
-                        }
-                    }
-                }
+            if (options.progressive_passes == 0){
+                writeImage(image, resx, resy, composite_image_name);
             }
-            */
-
-            // Consolidate all the threads' results into one image and write it.
-            for (int t = 0; t < num_threads; ++t){
-                for (unsigned int i = 0; i < thread_infos[t].columns.size(); ++i){
-                    for (int y = 0; y < resy; ++y){
-                        Vec3 pixel = thread_infos[t].pixels[i][y];
-                        img.plot(thread_infos[t].columns[i] + 1, y + 1, pixel[0], pixel[1], pixel[2]);
+            else{
+                // The light from photons is added on top of the image traced so far, a little more
+                // accurately after each pass, so the image written can be looked at any time.
+                cout << "Collecting hit points... ";
+                cout.flush();
+                vector<HitPoint> hit_points;
+                raytracer.collectHitPoints(hit_points);
+                cout << "done (" << hit_points.size() << ")" << endl;
+
+                int seed = time(NULL);
+                for (int pass = 0; pass < options.progressive_passes; ++pass){
+                    cout << "Progressive photon mapping pass " << (pass + 1) << " of " << options.progressive_passes << "... ";
+                    cout.flush();
+                    raytracer.progressivePass(hit_points, pass, num_threads, seed);
+                    cout << "done" << endl;
+
+                    vector<Color> pass_image = image;
+                    raytracer.addProgressiveRadiance(hit_points, pass + 1, pass_image);
+                    for (unsigned int i = 0; i < pass_image.size(); ++i){
+                        pass_image[i] = pass_image[i].asClamped0_1();
                     }
+                    writeImage(pass_image, resx, resy, composite_image_name);
                 }
             }
-    
-            img.close();
-
-            cout << "done" << endl;
 #endif
         }
         break;
@@ -145,7 +161,7 @@ int main(int argc, char *argv[]){
         
             cout << "Beginning server on port " << port << "." << endl;
             cout.flush();
-            Raytracer raytracer = processInput(input);
+            Raytracer raytracer = processInput(input, options);
         
             input.close();
         
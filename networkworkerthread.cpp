@@ -72,7 +72,7 @@ void NetworkWorkerThread::raytraceColumn(int col){
     pc.pixels.reserve(resy);
     
     for (int y = 0; y < resy; ++y){
-        Vec3 p_vec = raytracer.colorTrace(col, y, twister) * 255;
+        Vec3 p_vec = raytracer.colorTrace(col, y, twister, shadow_cache) * 255;
         Pixel p;
         p.r = (uint8_t) p_vec.x;
         p.g = (uint8_t) p_vec.y;
@@ -57,6 +57,9 @@ class NetworkWorkerThread{
     // We need independent RNGs for each thread.
     CRandomMersenne twister;
 
+    // And independent memories of what blocked each light.
+    ShadowCache shadow_cache;
+
     // Queue of which columns are to be done. Orders to add or remove columns are
     // performed at the end. Columns are popped off the front and raytraced on at a time.
     deque<int> columns_to_do;
@@ -0,0 +1,118 @@
+#include "photoncache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "raytracer.h"
+
+// Identifies a photon cache file.
+const char PHOTON_CACHE_MAGIC[4] = {'R', 'T', 'P', 'M'};
+
+// The start of a photon cache file. It's followed by the global photons and then the caustics
+// photons, each in heap order and stored exactly as they are in memory.
+struct PhotonCacheHeader{
+    char magic[4];
+    uint32_t version;
+    // Guards against the layout changing between builds without the version being bumped.
+    uint32_t photon_size;
+    uint32_t num_global, num_caustics;
+    uint64_t key;
+};
+
+uint64_t photonCacheKey(const vector<Light> &lights, const vector<Shape*> &shapes, const int num_photons){
+    // Serializing the scene gives every field of every light and shape, materials included.
+    stringstream ss;
+    {
+        boost::archive::text_oarchive archive(ss);
+        const vector<Light> &l = lights;
+        const vector<Shape*> &s = shapes;
+        archive << l;
+        archive << s;
+    }
+    ss << ' ' << num_photons << ' ' << GLOBAL_POWER_SCALING << ' ' << CAUSTICS_POWER_SCALING << ' '
+       << MAX_REFLECTIONS << ' ' << FRESNEL_REFLECTIVE_MIN << ' ' << EPSILON << ' ' << PHOTON_BATCH_SIZE << ' '
+       << PROJECTION_MAP_ROWS << ' ' << PROJECTION_MAP_COLUMNS;
+
+    // 64-bit FNV-1a.
+    string scene = ss.str();
+    uint64_t hash = 14695981039346656037ULL;
+    for (string::const_iterator c_iter = scene.begin(); c_iter != scene.end(); ++c_iter){
+        hash ^= (unsigned char) *c_iter;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+string photonCachePath(const string &directory, const uint64_t key){
+    char name[32];
+    sprintf(name, "photons-%016llx.bin", (unsigned long long) key);
+    return directory + "/" + name;
+}
+
+bool loadPhotonMaps(const string &path, const uint64_t key, PhotonMap &global, PhotonMap &caustics){
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1){
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == -1 || (size_t) info.st_size < sizeof(PhotonCacheHeader)){
+        close(fd);
+        return false;
+    }
+
+    // Map the file rather than reading it, so the photons are only copied once, straight into the maps.
+    void *mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED){
+        return false;
+    }
+
+    const PhotonCacheHeader *header = (const PhotonCacheHeader*) mapping;
+    bool valid = !memcmp(header->magic, PHOTON_CACHE_MAGIC, sizeof(PHOTON_CACHE_MAGIC)) &&
+                 header->version == PHOTON_CACHE_VERSION &&
+                 header->photon_size == sizeof(Photon) &&
+                 header->key == key &&
+                 (size_t) info.st_size == sizeof(PhotonCacheHeader) + ((size_t) header->num_global + header->num_caustics) * sizeof(Photon);
+    if (valid){
+        const Photon *photons = (const Photon*) ((const char*) mapping + sizeof(PhotonCacheHeader));
+        global = PhotonMap::fromHeapOrder(photons, photons + header->num_global);
+        caustics = PhotonMap::fromHeapOrder(photons + header->num_global, photons + header->num_global + header->num_caustics);
+    }
+    munmap(mapping, info.st_size);
+    return valid;
+}
+
+bool savePhotonMaps(const string &path, const uint64_t key, const PhotonMap &global, const PhotonMap &caustics){
+    const vector<Photon> &global_photons = global.heapOrder(), &caustics_photons = caustics.heapOrder();
+
+    PhotonCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PHOTON_CACHE_MAGIC, sizeof(PHOTON_CACHE_MAGIC));
+    header.version = PHOTON_CACHE_VERSION;
+    header.photon_size = sizeof(Photon);
+    header.num_global = global_photons.size();
+    header.num_caustics = caustics_photons.size();
+    header.key = key;
+
+    // Write to a temporary file and move it into place, so that a run loading the cache at the
+    // same time never sees half a file.
+    string temp_path = path + ".tmp";
+    FILE *file = fopen(temp_path.c_str(), "wb");
+    if (file == NULL){
+        return false;
+    }
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                   (global_photons.empty() || fwrite(&global_photons[0], sizeof(Photon), global_photons.size(), file) == global_photons.size()) &&
+                   (caustics_photons.empty() || fwrite(&caustics_photons[0], sizeof(Photon), caustics_photons.size(), file) == caustics_photons.size());
+    written = fclose(file) == 0 && written;
+    if (!written || rename(temp_path.c_str(), path.c_str()) != 0){
+        remove(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
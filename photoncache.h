@@ -0,0 +1,31 @@
+#ifndef PHOTONCACHE_H
+#define PHOTONCACHE_H
+
+#include "constants.h"
+
+#include <string>
+#include <vector>
+
+#include "shapes.h"
+#include "light.h"
+#include "photonmap.h"
+
+// Bump this whenever the layout of Photon or of the file changes, so old files are ignored.
+const uint32_t PHOTON_CACHE_VERSION = 1;
+
+// Hash everything that decides which photons get fired and where they land: the lights, the
+// shapes and their materials, the number of photons, and the constants photon tracing uses.
+uint64_t photonCacheKey(const vector<Light>&, const vector<Shape*>&, const int);
+
+// The file in the given directory that photon maps with the given key are cached in.
+string photonCachePath(const string&, const uint64_t);
+
+// Load the global and caustics photon maps cached with the given key at the given path. Return
+// false, leaving the maps alone, if there's no such file or it doesn't match the key.
+bool loadPhotonMaps(const string&, const uint64_t, PhotonMap&, PhotonMap&);
+
+// Cache the given global and caustics photon maps with the given key at the given path. Return
+// false if the file couldn't be written.
+bool savePhotonMaps(const string&, const uint64_t, const PhotonMap&, const PhotonMap&);
+
+#endif
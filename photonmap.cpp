@@ -1,21 +1,47 @@
 #include "photonmap.h"
 
+#include <cassert>
+#include <cmath>
 #include <limits>
 #include <algorithm>
-#include <stack>
-#include <queue>
-#include <utility>
-
-#define LEFT 0
-#define RIGHT 1
-
-inline void clampVector(Vec3 &v, const Vec3 &min, const Vec3 &max){
-    if (v.x < min.x) v.x = min.x;
-    else if (v.x > max.x) v.x = max.x;
-    if (v.y < min.y) v.y = min.y;
-    else if (v.y > max.y) v.y = max.y;
-    if (v.z < min.z) v.z = min.z;
-    else if (v.z > max.z) v.z = max.z;
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+
+const PhotonDirectionTable photon_directions;
+
+PhotonDirectionTable::PhotonDirectionTable(){
+    // Each angle decodes to the middle of the range of angles that encode to it.
+    for (int i = 0; i < 256; ++i){
+        float theta = (i + 0.5f) * (PI / 256), phi = (i + 0.5f) * (2 * PI / 256);
+        cos_theta[i] = cos(theta);
+        sin_theta[i] = sin(theta);
+        cos_phi[i] = cos(phi);
+        sin_phi[i] = sin(phi);
+    }
+}
+
+void Photon::encodeDirection(const Vec3 &direction, uint8_t &theta, uint8_t &phi){
+    int t = (int) (acos(max<float>(-1, min<float>(1, direction.z))) * (256 / PI));
+    int p = (int) floor(atan2(direction.y, direction.x) * (256 / (2 * PI)));
+    theta = min(t, 255);
+    // Wrap negative angles around to the top of the range.
+    phi = (uint8_t) (p & 255);
+}
+
+void Photon::setPower(const Color &c){
+    float largest = max(c.r, max(c.g, c.b));
+    // Anything too small for the exponent to represent is treated as black.
+    if (largest < 1e-32){
+        rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+        return;
+    }
+    int exponent;
+    // Scale so the largest component's mantissa fills the whole byte.
+    float scale = frexp(largest, &exponent) * 256 / largest;
+    rgbe[0] = (uint8_t) min<float>(c.r * scale, 255);
+    rgbe[1] = (uint8_t) min<float>(c.g * scale, 255);
+    rgbe[2] = (uint8_t) min<float>(c.b * scale, 255);
+    rgbe[3] = exponent + 128;
 }
 
 class PhotonComparator{
@@ -27,104 +53,192 @@ public:
     uint8_t axis;
 };
 
-PhotonMapNode::PhotonMapNode(Photon *photons, unsigned int length){
-    if (length > 0){
-        low_corner = photons[0].point, high_corner = photons[0].point;
-        for (unsigned int i = 0; i < length; ++i){
-            for (int j = 0; j < 3; ++j){
-                low_corner[j] = min<float>(low_corner[j], photons[i].point[j]);
-                high_corner[j] = max<float>(high_corner[j], photons[i].point[j]);
-            }
-        }
+// How many of the given number of photons go to the left of the root of a left-balanced
+// tree: every level is full except the last, which is filled from the left.
+inline unsigned int leftSubtreeSize(const unsigned int n){
+    if (n <= 1){
+        return 0;
     }
-    else{
-        low_corner = high_corner = Vec3();
+    // The largest power of two no greater than n: the width of the last level.
+    unsigned int last_level = 1;
+    while (last_level * 2 <= n){
+        last_level *= 2;
     }
-    split(photons, 0, length - 1, X_AXIS);
+    unsigned int half = last_level / 2, last_level_count = n - (last_level - 1);
+    return (half - 1) + min(last_level_count, half);
+}
+
+PhotonMap::PhotonMap(vector<Photon> &p, const int threads){
+    photons.resize(p.size());
+    balance(&p, 0, p.size(), 0, threads);
 }
 
-PhotonMapNode::PhotonMapNode(Photon *photons, unsigned int left, unsigned int right, 
-                             uint8_t axis, const Vec3 &low, const Vec3 &high) : low_corner(low), high_corner(high){
-    split(photons, left, right, axis);
+PhotonMap PhotonMap::fromHeapOrder(const Photon *begin, const Photon *end){
+    PhotonMap map;
+    map.photons.assign(begin, end);
+    return map;
 }
 
-void PhotonMapNode::split(Photon *photons, unsigned int left, unsigned int right, uint8_t ax){
-    if (right - left + 1 > MAX_PHOTONS_PER_NODE){
-        axis = ax;
-        sort(photons + left, photons + right + 1, PhotonComparator(axis));
-        
-        int median = (left + right) / 2;
-        partition_distance = (photons[median].point[axis] + photons[median + 1].point[axis]) / 2;
-        Vec3 mid_low_corner = low_corner, mid_high_corner = high_corner;
-        mid_low_corner[axis] = mid_high_corner[axis] = partition_distance;
-        children[LEFT] =  new PhotonMapNode(photons, left, median,      NEXT_AXIS(ax), low_corner, mid_high_corner);
-        children[RIGHT] = new PhotonMapNode(photons, median + 1, right, NEXT_AXIS(ax), mid_low_corner, high_corner);
+void PhotonMap::balance(vector<Photon> *unbalanced, const unsigned int begin, const unsigned int end, const unsigned int index,
+                        const int threads){
+    vector<Photon> &p = *unbalanced;
+    if (begin == end){
+        return;
     }
-    else{
-        children[LEFT] = children[RIGHT] = NULL;
-        partition_distance = 0;
-        axis = LEAF;
 
-        for (unsigned int i = 0; i < right - left + 1; ++i){
-            p.push_back(photons + i + left);
+    // Split over the axis the photons are most spread out along.
+    Vec3 low_corner = p[begin].point, high_corner = p[begin].point;
+    for (unsigned int i = begin + 1; i < end; ++i){
+        for (int j = 0; j < 3; ++j){
+            low_corner[j] = min<float>(low_corner[j], p[i].point[j]);
+            high_corner[j] = max<float>(high_corner[j], p[i].point[j]);
         }
     }
-}
+    Vec3 extent = high_corner - low_corner;
+    uint8_t axis = X_AXIS;
+    if (extent.y > extent[axis]){
+        axis = Y_AXIS;
+    }
+    if (extent.z > extent[axis]){
+        axis = Z_AXIS;
+    }
 
-PhotonMap::PhotonMap(Photon *photons, unsigned int length){
-    root = new PhotonMapNode(photons, length);
+    unsigned int median = begin + leftSubtreeSize(end - begin);
+    nth_element(p.begin() + begin, p.begin() + median, p.begin() + end, PhotonComparator(axis));
+    photons[index] = p[median];
+    photons[index].axis = axis;
+
+    if (threads > 1 && median - begin >= PHOTON_MAP_PARALLEL_THRESHOLD){
+        // The subtrees cover disjoint ranges of the input and disjoint slots of the heap, so
+        // build the left one on a new thread while this one builds the right. Each side gets
+        // half of the threads to pass on to its own children.
+        int left_threads = threads / 2;
+        boost::thread left_builder(boost::bind(&PhotonMap::balance, this, unbalanced, begin, median, 2 * index + 1,
+                                               left_threads));
+        balance(unbalanced, median + 1, end, 2 * index + 2, threads - left_threads);
+        left_builder.join();
+    }
+    else{
+        balance(unbalanced, begin, median, 2 * index + 1, 1);
+        balance(unbalanced, median + 1, end, 2 * index + 2, 1);
+    }
 }
 
-void PhotonMap::kNearestNeighbors(const Vec3 &point, unsigned int k, vector<Photon*> &k_nearest) const{
-    priority_queue<pair<float, Photon*> > nearest_photons;
-    nearest_photons.push(pair<float, Photon*>(numeric_limits<float>::infinity(), NULL));
-    stack<PhotonMapNode*> node_stack;
-    node_stack.push(root);
-
-    while (!node_stack.empty()){
-        PhotonMapNode node = *node_stack.top();
-        node_stack.pop();
+void PhotonMap::kNearestNeighbors(const Vec3 &point, const unsigned int k, NearestPhotons &nearest) const{
+    assert(k <= MAX_NEAREST_PHOTONS);
+    nearest.size = 0;
+    if (photons.empty() || k == 0){
+        return;
+    }
 
-        if (node.axis == LEAF){
-            for (unsigned int i = 0; i < node.p.size(); ++i){
-                nearest_photons.push(pair<float, Photon*>((node.p[i]->point - point).magnitude2(), node.p[i]));
-            }
-            while (nearest_photons.size() > k){
-                nearest_photons.pop();
-            }
+    // Anything is near enough until k photons have been found.
+    float max_distance2 = numeric_limits<float>::infinity();
+    pair<float, const Photon*> *heap = nearest.photons;
+
+    // Subtrees still to be searched, along with the squared distance from the point to
+    // the plane separating them from the point. Each one is deeper in the tree than the
+    // one below it, so the stack can never be deeper than the tree.
+    pair<unsigned int, float> node_stack[PHOTON_MAP_MAX_DEPTH];
+    int stack_size = 1;
+    node_stack[0] = pair<unsigned int, float>(0, 0);
+
+    while (stack_size > 0){
+        unsigned int index = node_stack[--stack_size].first;
+        // The largest distance may have shrunk since this subtree was pushed, in which case
+        // it's now entirely outside the sphere of nearest photons.
+        if (node_stack[stack_size].second > max_distance2){
+            continue;
         }
-        else{
-            Vec3 clamped_point = point;
-            clampVector(clamped_point, node.low_corner, node.high_corner);
-            if ((clamped_point - point).magnitude2() > nearest_photons.top().first){
-                // Optimization: Because the largest distance may shrink between when this node was
-                // pushed on the stack and when it was popped off and checked (now), the node might
-                // not even intersect the largest sphere and neither of its children should be added.
-                continue;
-            }
-            clamped_point[node.axis] = node.partition_distance;
-            if ((clamped_point - point).magnitude2() < nearest_photons.top().first){
-                node_stack.push(node.children[LEFT]);
-                node_stack.push(node.children[RIGHT]);
+
+        // Walk down to a leaf, searching the side of each plane the point is on first.
+        while (index < photons.size()){
+            const Photon &p = photons[index];
+            float distance2 = (p.point - point).magnitude2();
+            if (nearest.size < k){
+                heap[nearest.size++] = pair<float, const Photon*>(distance2, &p);
+                push_heap(heap, heap + nearest.size);
+                if (nearest.size == k){
+                    max_distance2 = heap[0].first;
+                }
             }
-            else if (point[node.axis] < node.partition_distance){
-                node_stack.push(node.children[LEFT]);
+            else if (pair<float, const Photon*>(distance2, &p) < heap[0]){
+                pop_heap(heap, heap + k);
+                heap[k - 1] = pair<float, const Photon*>(distance2, &p);
+                push_heap(heap, heap + k);
+                max_distance2 = heap[0].first;
             }
-            else{
-                node_stack.push(node.children[RIGHT]);
+
+            float delta = point[p.axis] - p.point[p.axis];
+            unsigned int near = 2 * index + (delta < 0 ? 1 : 2), far = 2 * index + (delta < 0 ? 2 : 1);
+            if (far < photons.size() && delta * delta < max_distance2){
+                node_stack[stack_size++] = pair<unsigned int, float>(far, delta * delta);
             }
+            index = near;
         }
     }
+}
+
+void PhotonMap::kNearestNeighbors(const Vec3 *points, const unsigned int count, const unsigned int k,
+                                  NearestPhotons *nearest) const{
+    for (unsigned int i = 0; i < count; ++i){
+        kNearestNeighbors(points[i], k, nearest[i]);
+    }
+}
+
+PhotonMap PhotonMap::irradianceMap(const unsigned int spacing, const unsigned int k, const int threads) const{
+    vector<Photon> irradiance((photons.size() + spacing - 1) / spacing);
+
+    // Every thread writes a separate range of the output, so they share nothing.
+    boost::thread_group estimators;
+    for (int t = 0; t < threads; ++t){
+        estimators.create_thread(boost::bind(&PhotonMap::estimateIrradiance, this, irradiance.size() * t / threads,
+                                             irradiance.size() * (t + 1) / threads, spacing, k, &irradiance));
+    }
+    estimators.join_all();
+
+    return PhotonMap(irradiance, threads);
+}
+
+void PhotonMap::estimateIrradiance(const unsigned int begin, const unsigned int end, const unsigned int spacing,
+                                   const unsigned int k, vector<Photon> *irradiance) const{
+    NearestPhotons nearest;
+    for (unsigned int i = begin; i < end; ++i){
+        const Photon &p = photons[i * spacing];
+        Vec3 normal = p.normal();
+        kNearestNeighbors(p.point, k, nearest);
+
+        // Only photons that arrived from above the surface light it.
+        Color total;
+        for (unsigned int j = 0; j < nearest.size; ++j){
+            float cos_incident = normal.dot(-nearest[j]->incidentDirection());
+            if (cos_incident > 0){
+                total += nearest[j]->power() * cos_incident;
+            }
+        }
+        if (nearest.maxDistance2() > 0){
+            total /= PI * nearest.maxDistance2();
+        }
 
-    if (isinf(nearest_photons.top().first)){
-        // Didn't have as many photons as requested.
-        nearest_photons.pop();
+        Photon &estimate = (*irradiance)[i];
+        estimate.point = p.point;
+        estimate.setNormal(normal);
+        estimate.setIncidentDirection(normal);
+        estimate.setPower(total);
     }
+}
 
-    k_nearest.clear();
-    k_nearest.reserve(min<int>(k, nearest_photons.size()));
-    while (!nearest_photons.empty()){
-        k_nearest.push_back(nearest_photons.top().second);
-        nearest_photons.pop();
+const Photon* PhotonMap::nearestFacing(const Vec3 &point, const Vec3 &normal, NearestPhotons &nearest) const{
+    kNearestNeighbors(point, IRRADIANCE_LOOKUP_AMT, nearest);
+
+    // The results are in heap order, not sorted, so look through all of them.
+    const Photon *best = NULL;
+    float best_distance2 = 0;
+    for (unsigned int i = 0; i < nearest.size; ++i){
+        if (normal.dot(nearest[i]->normal()) >= IRRADIANCE_NORMAL_AGREEMENT &&
+            (best == NULL || nearest.photons[i].first < best_distance2)){
+            best = nearest[i];
+            best_distance2 = nearest.photons[i].first;
+        }
     }
+    return best;
 }
@@ -3,94 +3,199 @@
 
 #include "constants.h"
 
+#include <utility>
+
 #include "vec3.h"
 #include "ray.h"
 
-const unsigned int MAX_PHOTONS_PER_NODE = 4; // Cannot be larger than 255!
+// The most photons a single search of a photon map can return.
+const unsigned int MAX_NEAREST_PHOTONS = 128;
 
-struct Photon{
-    Vec3 point, incident_direction, normal;
-    Color color;
+// The deepest a photon map can be. A left-balanced tree of this depth holds 2^32 - 1 photons,
+// which is more than can be indexed anyway. This bounds the size of the search stack.
+const int PHOTON_MAP_MAX_DEPTH = 32;
 
- private:
-    friend class boost::serialization::access;
-    
-    template<class Archive>
-    void serialize(Archive &ar, const unsigned int version){
-        ar & point;
-        ar & incident_direction;
-        ar & normal;
-        ar & color;
-    } 
+// Subtrees with fewer photons than this are always built on the current thread.
+const unsigned int PHOTON_MAP_PARALLEL_THRESHOLD = 8192;
+
+// How many photons to search for one with the right normal when looking up precomputed
+// irradiance, and how closely (as a dot product) the normals must agree.
+const unsigned int IRRADIANCE_LOOKUP_AMT = 8;
+const float IRRADIANCE_NORMAL_AGREEMENT = 0.9;
+
+// Sines and cosines of the angles a photon's directions are quantized to, so decoding one
+// takes four lookups rather than any trigonometry.
+struct PhotonDirectionTable{
+    PhotonDirectionTable();
+
+    float cos_theta[256], sin_theta[256], cos_phi[256], sin_phi[256];
 };
 
-class PhotonMapNode{
- private:
-    // Required by the serialization library.
-    PhotonMapNode() {}
+extern const PhotonDirectionTable photon_directions;
 
-    // Create a new kd-tree rooted at this node.
-    PhotonMapNode(Photon*, unsigned int);
+// A photon is stored compactly, since there are so many of them: its incident direction and
+// the normal of the surface it landed on as pairs of spherical angles of one byte each, and
+// its power as RGBE (three 8-bit mantissas sharing an 8-bit exponent). Together with its
+// position this takes 24 bytes instead of the 52 it would as floats.
+struct Photon{
+    Vec3 point;
 
-    // Create a new kd-tree with the subarray of the given array defined by
-    // the two given indices (INCLUSIVE) and the given axis. Used when 
-    // constructing the tree recursively.
-    PhotonMapNode(Photon*, unsigned int, unsigned int, uint8_t axis, const Vec3&, const Vec3&);
+    // The axis this photon splits its subtree of the photon map over. Set when the map
+    // is built; meaningless until then.
+    uint8_t axis;
 
-    // Split this PhotonMapNode into 2 new children over this node's axis.
-    void split(Photon*, unsigned int, unsigned int, uint8_t);
+    inline Vec3 incidentDirection() const { return decodeDirection(theta, phi); }
 
-    // This node's photons.
-    vector<Photon*> p;
+    // The given direction must be normalized.
+    inline void setIncidentDirection(const Vec3 &direction) { encodeDirection(direction, theta, phi); }
 
-    // The children of this node, if they exist.
-    PhotonMapNode *children[2];
+    inline Vec3 normal() const { return decodeDirection(normal_theta, normal_phi); }
 
-    // The bounds of this node in world coodinates.
-    Vec3 low_corner, high_corner;
+    // The given normal must be normalized.
+    inline void setNormal(const Vec3 &normal) { encodeDirection(normal, normal_theta, normal_phi); }
 
-    // The location of the splitting plane in world coordinates (along axis 'axis').
-    float partition_distance;
+    inline Color power() const{
+        if (rgbe[3] == 0){
+            return Color();
+        }
+        float f = ldexp(1.0f, (int) rgbe[3] - (128 + 8));
+        return Color((rgbe[0] + 0.5f) * f, (rgbe[1] + 0.5f) * f, (rgbe[2] + 0.5f) * f);
+    }
 
-    // Which axis this node is split over, or LEAF if it isn't.
-    uint8_t axis;
+    // The given color must not be negative.
+    void setPower(const Color&);
 
-    friend class PhotonMap;
+ private:
+    static inline Vec3 decodeDirection(const uint8_t theta, const uint8_t phi){
+        return Vec3(photon_directions.sin_theta[theta] * photon_directions.cos_phi[phi],
+                    photon_directions.sin_theta[theta] * photon_directions.sin_phi[phi],
+                    photon_directions.cos_theta[theta]);
+    }
+
+    static void encodeDirection(const Vec3&, uint8_t&, uint8_t&);
+
+    uint8_t theta, phi, normal_theta, normal_phi;
+    uint8_t rgbe[4];
 
     friend class boost::serialization::access;
-    
+
     template<class Archive>
     void serialize(Archive &ar, const unsigned int version){
-        ar & p;
-        ar & low_corner;
-        ar & high_corner;
-        ar & partition_distance;
+        ar & point;
         ar & axis;
-        ar & children;
-    } 
+        ar & theta;
+        ar & phi;
+        ar & normal_theta;
+        ar & normal_phi;
+        ar & rgbe;
+    }
+};
+
+// The result of searching a photon map: the nearest photons to a point, kept as a max-heap
+// on distance so the farthest is always first. It has a fixed capacity and belongs to the
+// caller so that searches never allocate; one can be reused for any number of searches.
+struct NearestPhotons{
+    NearestPhotons() : size(0) {}
+
+    // How many photons were found.
+    unsigned int size;
+
+    // The photons and their squared distances to the search point, in heap order.
+    pair<float, const Photon*> photons[MAX_NEAREST_PHOTONS];
+
+    inline const Photon* operator[](const unsigned int i) const { return photons[i].second; }
+
+    // The squared distance to the farthest photon found, which must not be empty.
+    inline float maxDistance2() const { return photons[0].first; }
 };
 
+// A kd-tree of photons, stored as a single left-balanced array in heap order. The
+// children of the photon at index i are at 2i + 1 and 2i + 2, so the tree needs no
+// pointers or nodes besides the photons themselves, and every photon but the leaves
+// also acts as a splitting plane (along its axis, through its point).
 class PhotonMap{
  public:
     // Instantiate an empty photon map.
     PhotonMap() {}
 
-    PhotonMap(Photon*, unsigned int);
-
-    // Find the k nearest neighbors to the given point and replace the contents
-    // of the supplied vector with them, with the farthest photon first.
-    void kNearestNeighbors(const Vec3&, unsigned int, vector<Photon*>&) const;
+    // Build a photon map out of the given photons, which are reordered in the process, using
+    // up to the given number of threads.
+    PhotonMap(vector<Photon>&, const int threads = 1);
+
+    // Instantiate a photon map out of photons that are already in heap order, as given by heapOrder().
+    static PhotonMap fromHeapOrder(const Photon*, const Photon*);
+
+    // All the photons in heap order, for saving the map as it is.
+    inline const vector<Photon>& heapOrder() const { return photons; }
+
+    // Find the k nearest neighbors to the given point, replacing the contents of the
+    // given result. k can't be larger than MAX_NEAREST_PHOTONS.
+    void kNearestNeighbors(const Vec3&, const unsigned int, NearestPhotons&) const;
+
+    // Find the k nearest neighbors to each of the given number of points, storing them in
+    // the corresponding element of the given array of results.
+    void kNearestNeighbors(const Vec3*, const unsigned int, const unsigned int, NearestPhotons*) const;
+
+    // Build a map of precomputed irradiance (Christensen's method) out of every given number of
+    // this map's photons: each photon of the new map has the normal and position of one of those,
+    // and as its power the irradiance estimated there from the given number of nearest photons.
+    // The estimate is split among up to the given number of threads.
+    PhotonMap irradianceMap(const unsigned int, const unsigned int, const int) const;
+
+    // Find the nearest photon to the given point whose normal agrees with the given normal,
+    // searching as far as the IRRADIANCE_LOOKUP_AMT nearest photons and using the given result
+    // as scratch space. Return NULL if none of them agree.
+    const Photon* nearestFacing(const Vec3&, const Vec3&, NearestPhotons&) const;
+
+    // Call the given function object with every photon within the given squared distance
+    // of the given point, in no particular order.
+    template<class Visitor>
+    void photonsWithin(const Vec3 &point, const float radius2, Visitor &visit) const{
+        if (photons.empty()){
+            return;
+        }
+        // As with kNearestNeighbors(), every subtree on the stack is deeper than the one below it.
+        unsigned int node_stack[PHOTON_MAP_MAX_DEPTH];
+        int stack_size = 1;
+        node_stack[0] = 0;
+        while (stack_size > 0){
+            unsigned int index = node_stack[--stack_size];
+            while (index < photons.size()){
+                const Photon &p = photons[index];
+                if ((p.point - point).magnitude2() <= radius2){
+                    visit(p);
+                }
+
+                float delta = point[p.axis] - p.point[p.axis];
+                unsigned int near = 2 * index + (delta < 0 ? 1 : 2), far = 2 * index + (delta < 0 ? 2 : 1);
+                if (far < photons.size() && delta * delta <= radius2){
+                    node_stack[stack_size++] = far;
+                }
+                index = near;
+            }
+        }
+    }
 
  private:
-    // The root of this kd-tree photon map.
-    PhotonMapNode *root;
+    // Move the median of the given range [begin, end) of the given photons into the given
+    // slot of the heap, then do the same for the rest of the range in its subtrees, using up
+    // to the given number of threads.
+    void balance(vector<Photon>*, const unsigned int, const unsigned int, const unsigned int, const int);
+
+    // Estimate the irradiance at every given number of photons in the given range [begin, end)
+    // of the output, from the given number of nearest photons, into the given output.
+    void estimateIrradiance(const unsigned int, const unsigned int, const unsigned int, const unsigned int,
+                            vector<Photon>*) const;
+
+    // All the photons in heap order.
+    vector<Photon> photons;
 
     friend class boost::serialization::access;
-    
+
     template<class Archive>
     void serialize(Archive &ar, const unsigned int version){
-        ar & root;
-    } 
+        ar & photons;
+    }
 };
 
 #endif
@@ -1,6 +1,7 @@
 #include "processinput.h"
 
 #include <cassert>
+#include <cstring>
 #include <unistd.h>
 
 #include "shapes.h"
@@ -67,7 +68,7 @@ void goToTag(istream &input, string tag){
     }
 }
 
-Raytracer processInput(istream &input){
+Raytracer processInput(istream &input, const RenderOptions &options){
     input.exceptions(istream::failbit | istream::badbit);
 
     try{
@@ -235,7 +236,7 @@ Raytracer processInput(istream &input){
         }
         cout << "done" << endl; // "Parsing input file... "
 
-        return Raytracer(eye, grid_center, rotation_degrees, resx, resy, scaling_factor, antialias_samples, photons, background, ambient, lights, shapes);
+        return Raytracer(eye, grid_center, rotation_degrees, resx, resy, scaling_factor, antialias_samples, photons, background, ambient, lights, shapes, options);
     }
     catch (istream::failure f){
         cerr << "Syntactical error while reading from input." << endl;
@@ -246,13 +247,13 @@ Raytracer processInput(istream &input){
     return Raytracer();
 }
 
-int processArguments(int argc, char **argv, string &host_ip, string &port, string &filename, uint8_t &num_threads){
+int processArguments(int argc, char **argv, string &host_ip, string &port, string &filename, RenderOptions &options){
     opterr = 0;
     int program_type = LOCAL;
     bool s_c_option_set = false;
 
     while (true){
-        int i = getopt(argc, argv, ":sc:p:t:");
+        int i = getopt(argc, argv, ":sc:p:t:b:a:igP:C:ARW");
         if (i == -1){
             break;
         }
@@ -276,6 +277,22 @@ int processArguments(int argc, char **argv, string &host_ip, string &port, strin
                 cerr << "Missing required thread count argument for -t option." << endl;
                 break;
 
+            case 'b':
+                cerr << "Missing required bin count argument for -b option." << endl;
+                break;
+
+            case 'a':
+                cerr << "Missing required structure argument for -a option." << endl;
+                break;
+
+            case 'P':
+                cerr << "Missing required pass count argument for -P option." << endl;
+                break;
+
+            case 'C':
+                cerr << "Missing required directory argument for -C option." << endl;
+                break;
+
             default:
                 assert(false);
             }
@@ -311,15 +328,84 @@ int processArguments(int argc, char **argv, string &host_ip, string &port, strin
                     cerr << "Invalid number of threads specified." << endl;
                     exit(EXIT_FAILURE);
                 }
-                num_threads = threads;
+                options.threads = threads;
             }
             break;
 
+        case 'b':
+            {
+                int bins = atoi(optarg);
+                if (bins < 2 || bins > KD_MAX_BINS){
+                    cerr << "Invalid number of kd-tree bins specified (must be between 2 and " << KD_MAX_BINS << ")." << endl;
+                    exit(EXIT_FAILURE);
+                }
+                options.kd_bins = bins;
+            }
+            break;
+
+        case 'a':
+            if (!strcmp(optarg, "bvh")){
+                options.use_bvh = true;
+            }
+            else if (!strcmp(optarg, "kdtree")){
+                options.use_bvh = false;
+            }
+            else{
+                cerr << "Invalid acceleration structure specified (must be kdtree or bvh)." << endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'i':
+            options.precompute_irradiance = true;
+            break;
+
+        case 'g':
+            options.final_gather = true;
+            break;
+
+        case 'P':
+            {
+                int passes = atoi(optarg);
+                if (passes < 1){
+                    cerr << "Invalid number of progressive photon mapping passes specified." << endl;
+                    exit(EXIT_FAILURE);
+                }
+                options.progressive_passes = passes;
+            }
+            break;
+
+        case 'C':
+            options.photon_cache = optarg;
+            break;
+
+        case 'A':
+            options.adaptive_aa = true;
+            break;
+
+        case 'R':
+            options.russian_roulette = true;
+            break;
+
+        case 'W':
+            options.wavefront = true;
+            break;
+
         default:
             assert(false);
         }
     }
 
+    if (options.progressive_passes > 0 && program_type != LOCAL){
+        cerr << "Error: progressive photon mapping (-P) is only supported when raytracing locally." << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if (options.wavefront && program_type != LOCAL){
+        cerr << "Error: wavefront rendering (-W) is only supported when raytracing locally." << endl;
+        exit(EXIT_FAILURE);
+    }
+
     if (program_type != CLIENT){
         if (optind < argc){
             filename = argv[optind];
@@ -33,12 +33,13 @@ void checkFloatIsPositive(float, string);
 // comments and other lines without useful information.
 void goToTag(istream&, string);
 
-// Process the test stream into a ready-to-go Raytracer object.
-Raytracer processInput(istream&);
+// Process the test stream into a ready-to-go Raytracer object, using the given
+// command line options.
+Raytracer processInput(istream&, const RenderOptions&);
 
 // Process the command line arguments, returning the type of program this is
 // instantiated as and filling the supplied arguments with the user-input
 // values, if they exist (and defaults otherwise).
-int processArguments(int, char**, string&, string&, string&, uint8_t&);
+int processArguments(int, char**, string&, string&, string&, RenderOptions&);
 
 #endif
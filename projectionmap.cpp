@@ -0,0 +1,79 @@
+#include "projectionmap.h"
+
+#include <algorithm>
+#include <cmath>
+
+ProjectionMap::ProjectionMap(const Vec3 &pos, const vector<Shape*> &shapes){
+    vector<bool> marked(PROJECTION_MAP_ROWS * PROJECTION_MAP_COLUMNS, false);
+    for (vector<Shape*>::const_iterator s_iter = shapes.begin(); s_iter != shapes.end(); ++s_iter){
+        const Shape *s = *s_iter;
+        if (s->mat.pct_refl <= 0 && s->mat.pct_refr <= 0){
+            continue;
+        }
+
+        // The sphere around the shape's bounding box.
+        Vec3 low_corner, high_corner;
+        for (int axis = 0; axis < 3; ++axis){
+            low_corner[axis] = s->extremeValue(axis, EXTREME_VALUE_SMALLEST);
+            high_corner[axis] = s->extremeValue(axis, EXTREME_VALUE_LARGEST);
+        }
+        Vec3 to_center = (low_corner + high_corner) * 0.5 - pos;
+        float radius = (high_corner - low_corner).magnitude() * 0.5;
+        float distance = to_center.magnitude();
+
+        if (distance <= radius){
+            // The light is inside the sphere, so any direction could reach the shape.
+            fill(marked.begin(), marked.end(), true);
+            break;
+        }
+        mark(to_center / distance, asin(radius / distance), marked);
+    }
+
+    for (unsigned int i = 0; i < marked.size(); ++i){
+        if (marked[i]){
+            cells.push_back(i);
+        }
+    }
+}
+
+void ProjectionMap::mark(const Vec3 &direction, const float angle, vector<bool> &marked){
+    float theta = acos(max(-1.0f, min(1.0f, direction.z)));
+    float phi = atan2(direction.y, direction.x);
+
+    // Mark every cell overlapping the range of both angles the cone spans, which is a slight
+    // overestimate but never misses any.
+    float low_z = cos(min(PI, theta + angle)), high_z = cos(max(0.0f, theta - angle));
+    int low_row = max(0, (int) floor((low_z + 1) * 0.5 * PROJECTION_MAP_ROWS));
+    int high_row = min(PROJECTION_MAP_ROWS - 1, (int) floor((high_z + 1) * 0.5 * PROJECTION_MAP_ROWS));
+
+    int low_column = 0, high_column = PROJECTION_MAP_COLUMNS - 1;
+    // Unless the cone covers a pole, it spans a limited range around the z axis.
+    if (theta - angle > 0 && theta + angle < PI){
+        float spread = asin(min(1.0f, sin(angle) / sin(theta)));
+        low_column = (int) floor((phi - spread + PI) / (2 * PI) * PROJECTION_MAP_COLUMNS);
+        high_column = (int) floor((phi + spread + PI) / (2 * PI) * PROJECTION_MAP_COLUMNS);
+        if (high_column - low_column >= PROJECTION_MAP_COLUMNS){
+            low_column = 0;
+            high_column = PROJECTION_MAP_COLUMNS - 1;
+        }
+    }
+
+    for (int row = low_row; row <= high_row; ++row){
+        for (int column = low_column; column <= high_column; ++column){
+            // The range can wrap around past either end.
+            int wrapped = (column % PROJECTION_MAP_COLUMNS + PROJECTION_MAP_COLUMNS) % PROJECTION_MAP_COLUMNS;
+            marked[row * PROJECTION_MAP_COLUMNS + wrapped] = true;
+        }
+    }
+}
+
+Vec3 ProjectionMap::sampleDirection(CRandomMersenne &twister) const{
+    // Every cell covers the same solid angle, so picking a cell uniformly and then a point
+    // uniformly within it (uniform in z and in the angle around z) is uniform over directions.
+    unsigned int cell = cells[twister.IRandom(0, cells.size() - 1)];
+    int row = cell / PROJECTION_MAP_COLUMNS, column = cell % PROJECTION_MAP_COLUMNS;
+    float z = -1 + (row + twister.Random()) * 2.0 / PROJECTION_MAP_ROWS;
+    float phi = -PI + (column + twister.Random()) * 2 * PI / PROJECTION_MAP_COLUMNS;
+    float r = sqrt(max(0.0f, 1 - z * z));
+    return Vec3(r * cos(phi), r * sin(phi), z);
+}
@@ -0,0 +1,45 @@
+#ifndef PROJECTIONMAP_H
+#define PROJECTIONMAP_H
+
+#include "constants.h"
+
+#include <vector>
+
+#include "vec3.h"
+#include "shapes.h"
+
+// The number of cells a projection map divides directions into: rows of equal height in
+// z (the cosine of the angle from the z axis) by columns of equal width in the angle
+// around it. Every cell covers the same solid angle.
+const int PROJECTION_MAP_ROWS = 64;
+const int PROJECTION_MAP_COLUMNS = 128;
+
+// Which directions from a light lead towards specular (reflective or refractive) shapes,
+// which are the only ones caustic photons can be fired in (Jensen's projection maps).
+class ProjectionMap{
+ public:
+    // Instantiate an empty projection map.
+    ProjectionMap() {}
+
+    // Mark every cell that the bounding sphere of any of the given shapes with a reflective or
+    // refractive material overlaps, as seen from the given point.
+    ProjectionMap(const Vec3&, const vector<Shape*>&);
+
+    // Whether no directions are marked.
+    inline bool empty() const { return cells.empty(); }
+
+    // The fraction of all directions that are marked.
+    inline float coverage() const { return (float) cells.size() / (PROJECTION_MAP_ROWS * PROJECTION_MAP_COLUMNS); }
+
+    // Pick a direction uniformly from the marked ones. The map must not be empty.
+    Vec3 sampleDirection(CRandomMersenne&) const;
+
+ private:
+    // Mark the cells within the given angle of the given direction.
+    void mark(const Vec3&, const float, vector<bool>&);
+
+    // The indices (row * PROJECTION_MAP_COLUMNS + column) of the marked cells.
+    vector<unsigned int> cells;
+};
+
+#endif
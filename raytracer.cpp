@@ -3,14 +3,18 @@
 #include <cmath>
 #include <algorithm>
 #include <set>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/thread/thread.hpp>
 
 #include "collision.h"
+#include "photoncache.h"
 
 Raytracer::Raytracer(const Vec3 &eye, const Vec3 &grid_center, float rotation_degrees,
                      int resx, int resy, float scaling_factor, int antialias_samples,
                      int num_photons,
                      const Color &background, const Color &ambient, 
-                     const vector<Light> &lights, const vector<Shape*> &shapes){
+                     const vector<Light> &lights, const vector<Shape*> &shapes, const RenderOptions &options){
 
     // Z: Looks from target towards camera.
     Vec3 cam_z_vec = (grid_center - eye).asNormal();
@@ -46,57 +50,198 @@ Raytracer::Raytracer(const Vec3 &eye, const Vec3 &grid_center, float rotation_de
     this->lights = lights;
 
     aa_samples = antialias_samples;
+    adaptive_aa = options.adaptive_aa;
+    russian_roulette = options.russian_roulette;
     this->resx = resx;
     this->resy = resy;
 
-    cerr << "Building kd-tree (" << shapes.size() << " shapes)... ";
+    using_bvh = options.use_bvh;
+    if (using_bvh){
+        cerr << "Building BVH (" << shapes.size() << " shapes)... ";
+    }
+    else{
+        cerr << "Building kd-tree (" << shapes.size() << " shapes, " << ((int) options.threads) << " threads";
+        if (options.kd_bins > 0){
+            cerr << ", " << options.kd_bins << " bins";
+        }
+        cerr << ")... ";
+    }
     cerr.flush();
-    kdtree = KDNode(shapes);
-    cerr << "done" << endl;
+    boost::posix_time::ptime build_start = boost::posix_time::microsec_clock::universal_time();
+    if (using_bvh){
+        bvh = BVH(shapes);
+    }
+    else{
+        kdtree = KDTree(shapes, options.threads, options.kd_bins);
+    }
+    boost::posix_time::time_duration build_time = boost::posix_time::microsec_clock::universal_time() - build_start;
+    cerr << "done in " << (build_time.total_milliseconds() / 1000.0) << "s ("
+         << (using_bvh ? bvh.statistics() : kdtree.statistics()) << ")" << endl;
     
-    if (num_photons != 0){
+    if (num_photons != 0 && !lights.empty()){
+        cerr << "Building projection maps (" << lights.size() << " lights)... ";
+        cerr.flush();
+        float coverage = 0;
+        for (vector<Light>::const_iterator l_iter = lights.begin(); l_iter != lights.end(); ++l_iter){
+            projection_maps.push_back(ProjectionMap(l_iter->pos, shapes));
+            coverage += projection_maps.back().coverage();
+        }
+        cerr << "done (" << (100 * coverage / lights.size()) << "% of directions reach specular shapes)" << endl;
+    }
+
+    progressive_photons = 0;
+    if (num_photons != 0 && options.progressive_passes > 0){
+        // Photons are fired pass by pass later, and gathered at hit points rather than while shading.
+        using_photons = false;
+        using_irradiance = false;
+        progressive_photons = num_photons;
+    }
+    else if (num_photons != 0){
         using_photons = true;
-        createPhotonMap(num_photons, lights);
+        createPhotonMap(num_photons, lights, shapes, options);
+
+        if (options.final_gather && !shapes.empty()){
+            // The cache covers every shape in the scene.
+            Vec3 low_corner, high_corner;
+            for (int axis = 0; axis < 3; ++axis){
+                low_corner[axis] = shapes[0]->extremeValue(axis, EXTREME_VALUE_SMALLEST);
+                high_corner[axis] = shapes[0]->extremeValue(axis, EXTREME_VALUE_LARGEST);
+                for (vector<Shape*>::const_iterator s_iter = shapes.begin() + 1; s_iter != shapes.end(); ++s_iter){
+                    low_corner[axis] = min(low_corner[axis], (*s_iter)->extremeValue(axis, EXTREME_VALUE_SMALLEST));
+                    high_corner[axis] = max(high_corner[axis], (*s_iter)->extremeValue(axis, EXTREME_VALUE_LARGEST));
+                }
+            }
+            irradiance_cache.reset(new IrradianceCache(low_corner, high_corner));
+            cerr << "Final gathering " << (FINAL_GATHER_STRATA * FINAL_GATHER_STRATA) << " rays per irradiance cache sample" << endl;
+        }
     }
     else{
         using_photons = false;
+        using_irradiance = false;
     }
 }
 
-Color Raytracer::colorTrace(int x, int y, CRandomMersenne& twister) const{
-    Ray r;
+Color Raytracer::colorTrace(int x, int y, CRandomMersenne& twister, ShadowCache& shadow_cache) const{
     if (aa_samples == 1){
         // 0.5 makes the ray go through the middle of the grid space.
-        r.origin = origin + (cam_x_vec * (x + 0.5)) + (cam_y_vec * (y + 0.5));
-        r.direction = r.origin - eye;
-        r.direction.normalize();
-
-        return colorTrace(r, twister);
+        return colorTrace(pixelRay(x + 0.5, y + 0.5), twister, shadow_cache);
     }
     
+    // The samples of a pixel are nearly identical, so they are collided with the scene in
+    // packets before being shaded one by one.
     Color total_color(0, 0, 0);
+    int num_samples = 0;
+    Ray rays[KD_PACKET_SIZE];
+    Color colors[KD_PACKET_SIZE];
+    Shape const *shapes[KD_PACKET_SIZE];
+
+    if (adaptive_aa && aa_samples > ADAPTIVE_AA_SIDE){
+        // Start with one sample in each square of a coarser grid, and only go on to the full
+        // grid if they disagree.
+        for (int i = 0; i < ADAPTIVE_AA_SIDE; ++i){
+            for (int j = 0; j < ADAPTIVE_AA_SIDE; ++j){
+                rays[i * ADAPTIVE_AA_SIDE + j] = pixelRay(x + (i + (float) twister.Random()) / ADAPTIVE_AA_SIDE,
+                                                          y + (j + (float) twister.Random()) / ADAPTIVE_AA_SIDE);
+            }
+        }
+        num_samples = ADAPTIVE_AA_SIDE * ADAPTIVE_AA_SIDE;
+        traceSamples(rays, num_samples, twister, shadow_cache, colors, shapes);
+
+        Color low = colors[0], high = colors[0];
+        bool refine = false;
+        for (int k = 0; k < num_samples; ++k){
+            total_color += colors[k];
+            for (int c = 0; c < 3; ++c){
+                low[c] = min(low[c], colors[k][c]);
+                high[c] = max(high[c], colors[k][c]);
+            }
+            // An edge can pass between samples of nearly the same color.
+            refine = refine || shapes[k] != shapes[0];
+        }
+        for (int c = 0; c < 3; ++c){
+            // Mitchell's contrast, which allows for how much more visible differences between
+            // dark colors are than the same differences between bright ones.
+            refine = refine || (high[c] - low[c]) > ADAPTIVE_AA_CONTRAST[c] * (high[c] + low[c] + EPSILON);
+        }
+        if (!refine){
+            return total_color / num_samples;
+        }
+    }
+
+    int num_rays = 0, remaining = aa_samples * aa_samples;
     for (int i = 0; i < aa_samples; ++i){
         for (int j = 0; j < aa_samples; ++j){
             // Sample randomly, but make sure each subpixel grid square gets representation.
-            r.origin = origin + (cam_x_vec * (x + (i + (float) twister.Random()) / aa_samples))
-                              + (cam_y_vec * (y + (j + (float) twister.Random()) / aa_samples));
-            r.direction = r.origin - eye;
-            r.direction.normalize();
-            
-            total_color += colorTrace(r, twister);
+            rays[num_rays++] = pixelRay(x + (i + (float) twister.Random()) / aa_samples,
+                                        y + (j + (float) twister.Random()) / aa_samples);
+            --remaining;
+
+            if (num_rays < KD_PACKET_SIZE && remaining > 0){
+                continue;
+            }
+            traceSamples(rays, num_rays, twister, shadow_cache, colors, shapes);
+            for (int k = 0; k < num_rays; ++k){
+                total_color += colors[k];
+            }
+            num_rays = 0;
         }
     }
-    return total_color / (aa_samples * aa_samples);
+    num_samples += aa_samples * aa_samples;
+    return total_color / num_samples;
 }
 
-Color Raytracer::colorTrace(const Ray &r, CRandomMersenne& twister, int depth) const{
-    if (depth == MAX_REFLECTIONS){
-        return bkrd;
+Ray Raytracer::pixelRay(const float x, const float y) const{
+    Ray r;
+    r.origin = origin + (cam_x_vec * x) + (cam_y_vec * y);
+    r.direction = r.origin - eye;
+    r.direction.normalize();
+    return r;
+}
+
+void Raytracer::traceSamples(const Ray *rays, const int num_rays, CRandomMersenne &twister, ShadowCache &shadow_cache,
+                             Color *colors, Shape const **shapes) const{
+    Collision collisions[KD_PACKET_SIZE];
+    if (num_rays == KD_PACKET_SIZE){
+        collidePacket(rays, collisions);
+    }
+    else{
+        for (int k = 0; k < num_rays; ++k){
+            collide(rays[k], collisions[k]);
+        }
     }
+    for (int k = 0; k < num_rays; ++k){
+        colors[k] = shade(rays[k], collisions[k], twister, shadow_cache);
+        shapes[k] = collisions[k].collided ? collisions[k].shape : NULL;
+    }
+}
 
+Color Raytracer::colorTrace(const Ray &r, CRandomMersenne& twister, ShadowCache& shadow_cache) const{
     Collision closest;
-    kdtree.collide(r, closest);
+    collide(r, closest);
+    return shade(r, closest, twister, shadow_cache);
+}
+
+// A surface in the ray tree whose branches are still being traced.
+struct RayTreeNode{
+    // The node's own color plus its finished branches' colors, each times its weight.
+    Color sum;
+    // The node's weight in its parent's color.
+    float weight;
+    // How many of its branches are still being traced.
+    int pending;
+    // Whether the node's color is clamped once it's finished, as it is for every surface.
+    bool clamped;
+};
+
+// A branch of the ray tree waiting to be traced.
+struct PendingBranch{
+    RayBranch branch;
+    int depth;
+    // How much the branch's color could change the color being computed.
+    float contribution;
+};
 
+Color Raytracer::shade(const Ray &r, const Collision &closest, CRandomMersenne& twister, ShadowCache& shadow_cache) const{
     if (RENDER_PHOTON_MAP_ONLY){
         if (!closest.collided){
             return Color();
@@ -104,22 +249,268 @@ Color Raytracer::colorTrace(const Ray &r, CRandomMersenne& twister, int depth) c
         
         Vec3 collision_point = r.pointAt(closest.distance);
 
-        vector<Photon*> photons;
+        NearestPhotons nearest;
         
-        global_map.kNearestNeighbors(collision_point, 1, photons);
-        Color c_photons_global;
-        if (photons.size() > 0 && (photons[0]->point - collision_point).magnitude2() < 2){
-            return photons[0]->color;
+        global_map.kNearestNeighbors(collision_point, 1, nearest);
+        if (nearest.size > 0 && nearest.maxDistance2() < 2){
+            return nearest[0]->power();
         }
         
         return Color();
     }
-    
+
+    // Walk the tree of reflected and refracted rays depth first with a stack rather than by
+    // recursing. Only the nodes on the path to the current one are ever unfinished, so there's
+    // at most one per depth, each with at most MAX_RAY_BRANCHES branches waiting.
+    RayTreeNode nodes[MAX_REFLECTIONS];
+    PendingBranch pending[MAX_REFLECTIONS * MAX_RAY_BRANCHES];
+    int num_pending = 0;
+
+    Ray ray = r;
+    Collision collision = closest;
+    int depth = 0;
+    float weight = 1, contribution = 1;
+    while (true){
+        RayBranch branches[MAX_RAY_BRANCHES];
+        int num_branches = 0;
+        RayTreeNode &node = nodes[depth];
+        node.clamped = shadeLocally(ray, collision, twister, shadow_cache, node.sum, branches, num_branches);
+        node.weight = weight;
+        node.pending = 0;
+
+        // Push the branches backwards, so they're traced in the order they were given.
+        for (int i = num_branches - 1; i >= 0; --i){
+            RayBranch &branch = branches[i];
+            if (depth + 1 == MAX_REFLECTIONS){
+                // The tree has gone too far.
+                node.sum += bkrd * branch.weight;
+                continue;
+            }
+
+            // Branches that can't change the color by a visible amount aren't worth tracing.
+            // With Russian roulette, a few of them are traced anyway with their weight scaled
+            // up to make up for the rest, so that on average nothing is lost.
+            float branch_contribution = contribution * branch.weight;
+            if (branch_contribution < RAY_TREE_MIN_CONTRIBUTION){
+                if (!russian_roulette){
+                    continue;
+                }
+                float survival = branch_contribution / RAY_TREE_MIN_CONTRIBUTION;
+                if (twister.Random() >= survival){
+                    continue;
+                }
+                branch.weight /= survival;
+                branch_contribution = RAY_TREE_MIN_CONTRIBUTION;
+            }
+
+            PendingBranch &p = pending[num_pending++];
+            p.branch = branch;
+            p.depth = depth + 1;
+            p.contribution = branch_contribution;
+            ++node.pending;
+        }
+
+        // Finish this node and every node above it that was only waiting on it.
+        if (node.pending == 0){
+            Color color = node.clamped ? node.sum.asClamped0_1() : node.sum;
+            while (depth > 0){
+                RayTreeNode &parent = nodes[depth - 1];
+                parent.sum += color * nodes[depth].weight;
+                if (--parent.pending > 0){
+                    break;
+                }
+                color = parent.clamped ? parent.sum.asClamped0_1() : parent.sum;
+                --depth;
+            }
+            if (depth == 0){
+                return color;
+            }
+        }
+
+        PendingBranch &next = pending[--num_pending];
+        ray = next.branch.ray;
+        weight = next.branch.weight;
+        depth = next.depth;
+        contribution = next.contribution;
+        collision = Collision();
+        collide(ray, collision);
+    }
+}
+
+// Spread the low 10 bits of the given value out to every third bit.
+inline uint64_t spreadBits(uint64_t v){
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x30000ff;
+    v = (v | (v << 8)) & 0x300f00f;
+    v = (v | (v << 4)) & 0x30c30c3;
+    v = (v | (v << 2)) & 0x9249249;
+    return v;
+}
+
+// Sort the given rays by their keys, computing them from the box around the rays' origins.
+void sortWavefront(vector<WavefrontRay> &rays){
+    Vec3 low = rays[0].ray.origin, high = low;
+    for (vector<WavefrontRay>::const_iterator r_iter = rays.begin(); r_iter != rays.end(); ++r_iter){
+        for (int axis = 0; axis < 3; ++axis){
+            low[axis] = min(low[axis], r_iter->ray.origin[axis]);
+            high[axis] = max(high[axis], r_iter->ray.origin[axis]);
+        }
+    }
+    Vec3 scale;
+    for (int axis = 0; axis < 3; ++axis){
+        scale[axis] = high[axis] > low[axis] ? 1023 / (high[axis] - low[axis]) : 0;
+    }
+
+    for (vector<WavefrontRay>::iterator r_iter = rays.begin(); r_iter != rays.end(); ++r_iter){
+        // The octant goes in the top bits, since only rays with the same one can share a packet.
+        uint64_t key = 0;
+        for (int axis = 0; axis < 3; ++axis){
+            key |= (uint64_t) (r_iter->ray.direction[axis] < 0) << (30 + axis);
+            key |= spreadBits((uint64_t) ((r_iter->ray.origin[axis] - low[axis]) * scale[axis])) << axis;
+        }
+        r_iter->key = key;
+    }
+    sort(rays.begin(), rays.end());
+}
+
+void Raytracer::wavefrontTrace(const pair<int, int> *pixels, const int num_pixels, CRandomMersenne &twister,
+                               ShadowCache &shadow_cache, WavefrontState &state, Color *colors) const{
+    if (RENDER_PHOTON_MAP_ONLY){
+        for (int p = 0; p < num_pixels; ++p){
+            colors[p] = colorTrace(pixels[p].first, pixels[p].second, twister, shadow_cache);
+        }
+        return;
+    }
+
+    vector<WavefrontRay> &rays = state.rays, &next_rays = state.next_rays;
+    vector<Collision> &collisions = state.collisions;
+    vector<WavefrontNode> &nodes = state.nodes;
+
+    // The camera rays come first, so each one's node is its index. They're already coherent in
+    // the order the pixels are given in, so they aren't sorted.
+    rays.clear();
+    int samples = aa_samples * aa_samples;
+    for (int p = 0; p < num_pixels; ++p){
+        int x = pixels[p].first, y = pixels[p].second;
+        for (int i = 0; i < aa_samples; ++i){
+            for (int j = 0; j < aa_samples; ++j){
+                WavefrontRay r;
+                if (aa_samples == 1){
+                    r.ray = pixelRay(x + 0.5, y + 0.5);
+                }
+                else{
+                    r.ray = pixelRay(x + (i + (float) twister.Random()) / aa_samples,
+                                     y + (j + (float) twister.Random()) / aa_samples);
+                }
+                r.node = rays.size();
+                r.depth = 0;
+                r.contribution = 1;
+                rays.push_back(r);
+            }
+        }
+    }
+    nodes.resize(rays.size());
+
+    for (bool camera = true; !rays.empty(); camera = false){
+        if (!camera){
+            sortWavefront(rays);
+        }
+
+        collisions.assign(rays.size(), Collision());
+        unsigned int i = 0;
+        for (; i + KD_PACKET_SIZE <= rays.size(); i += KD_PACKET_SIZE){
+            Ray packet[KD_PACKET_SIZE];
+            for (int k = 0; k < KD_PACKET_SIZE; ++k){
+                packet[k] = rays[i + k].ray;
+            }
+            collidePacket(packet, &collisions[i]);
+        }
+        for (; i < rays.size(); ++i){
+            collide(rays[i].ray, collisions[i]);
+        }
+
+        // Shade every ray, and queue up the rays they spawn for the next wave the same way
+        // shade() would trace them.
+        next_rays.clear();
+        for (i = 0; i < rays.size(); ++i){
+            const WavefrontRay &r = rays[i];
+            RayBranch branches[MAX_RAY_BRANCHES];
+            WavefrontNode node;
+            node.num_branches = 0;
+            node.clamped = shadeLocally(r.ray, collisions[i], twister, shadow_cache, node.color, branches, node.num_branches);
+            node.cut = r.depth + 1 == MAX_REFLECTIONS;
+            for (int k = 0; k < node.num_branches; ++k){
+                node.branches[k] = WAVEFRONT_PRUNED;
+                node.weights[k] = branches[k].weight;
+                if (node.cut){
+                    continue;
+                }
+
+                float contribution = r.contribution * branches[k].weight;
+                if (contribution < RAY_TREE_MIN_CONTRIBUTION){
+                    if (!russian_roulette){
+                        continue;
+                    }
+                    float survival = contribution / RAY_TREE_MIN_CONTRIBUTION;
+                    if (twister.Random() >= survival){
+                        continue;
+                    }
+                    node.weights[k] /= survival;
+                    contribution = RAY_TREE_MIN_CONTRIBUTION;
+                }
+
+                WavefrontRay next;
+                next.ray = branches[k].ray;
+                next.node = nodes.size();
+                next.depth = r.depth + 1;
+                next.contribution = contribution;
+                next_rays.push_back(next);
+                node.branches[k] = nodes.size();
+                nodes.push_back(WavefrontNode());
+            }
+            nodes[r.node] = node;
+        }
+        rays.swap(next_rays);
+    }
+
+    // Every node comes after the node that spawned it, so going backwards finishes every node's
+    // branches before the node itself. The colors are added in the same order as in shade(),
+    // so they round the same way.
+    for (int n = nodes.size() - 1; n >= 0; --n){
+        WavefrontNode &node = nodes[n];
+        if (node.cut){
+            for (int k = node.num_branches - 1; k >= 0; --k){
+                node.color += bkrd * node.weights[k];
+            }
+        }
+        else{
+            for (int k = 0; k < node.num_branches; ++k){
+                if (node.branches[k] != WAVEFRONT_PRUNED){
+                    node.color += nodes[node.branches[k]].color * node.weights[k];
+                }
+            }
+        }
+        if (node.clamped){
+            node.color = node.color.asClamped0_1();
+        }
+    }
+
+    for (int p = 0; p < num_pixels; ++p){
+        Color total_color(0, 0, 0);
+        for (int k = 0; k < samples; ++k){
+            total_color += nodes[p * samples + k].color;
+        }
+        colors[p] = total_color / samples;
+    }
+}
+
+bool Raytracer::shadeLocally(const Ray &r, const Collision &closest, CRandomMersenne& twister, ShadowCache& shadow_cache,
+                             Color &color, RayBranch *branches, int &num_branches) const{
     Collision closest_light;
     closest_light.distance = 0; // Shutup, compiler.
     vector<Light>::const_iterator light_iter;
     for (light_iter = lights.begin(); light_iter != lights.end(); ++light_iter){
-        Light l = *light_iter;
+        const Light &l = *light_iter;
         float t = l.collide(r);
         if (t > 0 && (t < closest_light.distance || !closest_light.collided)){
             closest_light.collided = true;
@@ -131,7 +522,8 @@ Color Raytracer::colorTrace(const Ray &r, CRandomMersenne& twister, int depth) c
         }
     }
     if (closest_light.collided && (closest_light.distance < closest.distance || !closest.collided)){
-        return closest_light.normal;
+        color = closest_light.normal;
+        return false;
     }
 
     if (closest.collided){
@@ -141,49 +533,15 @@ Color Raytracer::colorTrace(const Ray &r, CRandomMersenne& twister, int depth) c
         Vec3 collision_point = r.pointAt(closest.distance) + (closest.normal * EPSILON);
 
         Color c_intrinsic = ambient * s->mat.color;
-        // Only shade calculation for each source.
-        for (light_iter = lights.begin(); light_iter != lights.end(); ++light_iter){
-            Light l = *light_iter;
-            float shade = 0;
-            vector<Vec3> points = l.samplePoints(twister);
-            vector<Vec3>::const_iterator point_iter;
-            for (point_iter = points.begin(); point_iter != points.end(); ++point_iter){
-                if (!booleanTrace(collision_point, *point_iter)){
-                    ++shade;
-                }
-            }
+        addDirectLighting(r, closest, collision_point, twister, shadow_cache, c_intrinsic);
 
-            if (shade == 0){
-                continue;
-            }
-            
-            shade /= points.size();
-
-            Vec3 collision_to_light_direction = l.pos - collision_point;
-            float falloff = min<float>(1, FALLOFF / collision_to_light_direction.magnitude2()) * shade;
-            collision_to_light_direction.normalize();
-                    
-            float diffuse = closest.normal.dot(collision_to_light_direction);
-            if (diffuse > 0){
-                c_intrinsic += (s->mat.color * l.color) * (s->mat.k_diffuse * diffuse * falloff);
-            }
-
-            if (false && s->mat.k_specular > 0){
-                Vec3 light_refl_direction = collision_to_light_direction - (closest.normal * 2 * closest.normal.dot(collision_to_light_direction));
-                float specular = pow(light_refl_direction.dot((r.origin - collision_point).asNormal()), s->mat.shininess);
-                c_intrinsic += (s->mat.color * l.color) * (s->mat.k_specular * specular * falloff);
-            }
-        }
-
-        Color c_reflected;
         if (s->mat.pct_refl > 0){
-            Ray r_reflected;
-            r_reflected.origin = collision_point;
-            r_reflected.direction = r.direction - (closest.normal * 2 * closest.normal.dot(r.direction));
-            c_reflected = colorTrace(r_reflected, twister, depth + 1);
+            RayBranch &reflected = branches[num_branches++];
+            reflected.ray.origin = collision_point;
+            reflected.ray.direction = r.direction - (closest.normal * 2 * closest.normal.dot(r.direction));
+            reflected.weight = s->mat.pct_refl;
         }
 
-        Color c_refracted;
         // Only works if no two refractive objects intersect in any way.
         if (s->mat.pct_refr > 0){
             Ray r_refracted;
@@ -212,7 +570,9 @@ Color Raytracer::colorTrace(const Ray &r, CRandomMersenne& twister, int depth) c
                 // one's origin is inside the object. This is why we don't modify r_refracted.origin.
                 r_refracted.direction = r.direction - (closest.normal * 2 * closest.normal.dot(r.direction));
                 
-                c_refracted = colorTrace(r_refracted, twister, depth + 1);
+                RayBranch &refracted = branches[num_branches++];
+                refracted.ray = r_refracted;
+                refracted.weight = s->mat.pct_refr;
             }
             else{
                 // Apply Fresnel's equations.
@@ -223,126 +583,231 @@ Color Raytracer::colorTrace(const Ray &r, CRandomMersenne& twister, int depth) c
                 float r_perp = (n1 * cos_i - n2 * cos_t) / (n1 * cos_i + n2 * cos_t);
                 float pct_reflected = 0.5 * (r_par * r_par + r_perp * r_perp);
                 
+                RayBranch &refracted = branches[num_branches++];
+                refracted.ray = r_refracted;
                 // For performance reasons, ignore the effect of Fresnel if it has a negligible impact.
                 if (pct_reflected < FRESNEL_REFLECTIVE_MIN){
-                    c_refracted = colorTrace(r_refracted, twister, depth + 1);
+                    refracted.weight = s->mat.pct_refr;
                 }
                 else{
-                    Ray r_reflected;
-                    r_reflected.origin = collision_point;
-                    r_reflected.direction = r.direction - (closest.normal * 2 * closest.normal.dot(r.direction));
+                    refracted.weight = s->mat.pct_refr * (1 - pct_reflected);
 
-                    c_refracted = colorTrace(r_refracted, twister, depth + 1) * (1 - pct_reflected) + 
-                                  colorTrace(r_reflected, twister, depth + 1) * pct_reflected;
+                    RayBranch &reflected = branches[num_branches++];
+                    reflected.ray.origin = collision_point;
+                    reflected.ray.direction = r.direction - (closest.normal * 2 * closest.normal.dot(r.direction));
+                    reflected.weight = s->mat.pct_refr * pct_reflected;
                 }
             }
         }
 
         Color c_photons;
         if (using_photons){
-            /*
-            Ray radiance_ray;
-            radiance_ray.origin = collision_point;
-            for (int i = 0; i < 10; ++i){
-                radiance_ray.direction = r.direction - (closest.normal * 2 * closest.normal.dot(r.direction));
-
-                Vec3 x_dir(radiance_ray.direction.z, radiance_ray.direction.y, -radiance_ray.direction.x);
-                Vec3 y_dir = radiance_ray.direction.cross(x_dir);
-
-                float x_offset, y_offset;
-                do{
-                    x_offset = 2 * (twister.Random() - 0.5) * 0.25;
-                    y_offset = 2 * (twister.Random() - 0.5) * 0.25;
-                }
-                while ((x_offset * x_offset + y_offset * y_offset) > (0.25 * 0.25));
-
-                radiance_ray.direction += x_dir * x_offset + y_dir * y_offset;
-                radiance_ray.direction.normalize();
-
-                c_photons += radianceTrace(radiance_ray);
+            // Final gathering looks at the photon maps from the surfaces around this point
+            // rather than gathering photons here, which is smoother but much more expensive.
+            if (irradiance_cache){
+                c_photons += (s->mat.color * finalGather(collision_point, closest.normal, twister, shadow_cache)) * s->mat.k_diffuse;
             }
-
-            c_photons /= 10;*/
-
-            
-            vector<Photon*> photons;
-            global_map.kNearestNeighbors(collision_point, K_NEAREST_AMT, photons);
-
-            if (photons.size() > 0){
-                Color c_photons_global;
-                for (vector<Photon*>::iterator p_iter = photons.begin(); p_iter != photons.end(); ++p_iter){
-                    Photon *p = *p_iter;
-                    float diffuse = closest.normal.dot(-(p->incident_direction));
-                    if (diffuse > 0){
-                        c_photons_global += (s->mat.color * p->color) * (s->mat.k_diffuse * diffuse);
-                    }
-                }
-                
-                c_photons_global /= (PI * (photons[0]->point - collision_point).magnitude2());
-                
-                c_photons += c_photons_global;
+            else{
+                c_photons += photonRadiance(collision_point, closest);
             }
-            
-            caustics_map.kNearestNeighbors(collision_point, K_NEAREST_AMT, photons);
 
-            if (photons.size() > 0){
+            NearestPhotons nearest;
+            caustics_map.kNearestNeighbors(collision_point, K_NEAREST_AMT, nearest);
+
+            if (nearest.size > 0){
                 Color c_photons_caustic;
-                for (vector<Photon*>::iterator p_iter = photons.begin(); p_iter != photons.end(); ++p_iter){
-                    c_photons_caustic += (*p_iter)->color;
+                for (unsigned int i = 0; i < nearest.size; ++i){
+                    c_photons_caustic += nearest[i]->power();
                 }
                 
-                c_photons_caustic /= (PI * (photons[0]->point - collision_point).magnitude2());
+                c_photons_caustic /= (PI * nearest.maxDistance2());
                 
                 c_photons += c_photons_caustic;
             }
         }
 
         // Since the lighting model allows the values to be outside [0, 1] (more frequently being too high than too low, if that ever even happens),
-        // we have to clamp the value to the allowable range before it leaves this function. All other code should expect valid values.
-        return (c_intrinsic * (1 - s->mat.pct_refl - s->mat.pct_refr) + c_reflected * s->mat.pct_refl + c_refracted * s->mat.pct_refr + c_photons).asClamped0_1();
+        // the color has to be clamped to the allowable range once the branches are added. All other code should expect valid values.
+        color = c_intrinsic * (1 - s->mat.pct_refl - s->mat.pct_refr) + c_photons;
+        return true;
     }
 
-    return bkrd;
+    color = bkrd;
+    return false;
 }
 
-bool Raytracer::booleanTrace(const Vec3 &from, const Vec3 &to) const{
+bool Raytracer::booleanTrace(const Vec3 &from, const Vec3 &to, const Shape *&occluder) const{
     Ray r;
     r.origin = from;
     r.direction = to - from;
     float dist = r.direction.magnitude();
     r.direction.normalize();
 
-    return kdtree.collideBoolean(r, dist);
+    if (occluder != NULL){
+        Collision c = occluder->collide(r);
+        if (c.collided && c.distance < dist){
+            return true;
+        }
+    }
+    return collideBoolean(r, dist, occluder);
+}
+
+void Raytracer::collide(const Ray &r, Collision &c) const{
+    if (using_bvh){
+        bvh.collide(r, c);
+    }
+    else{
+        kdtree.collide(r, c);
+    }
+}
+
+bool Raytracer::collideBoolean(const Ray &r, const float d, const Shape *&occluder) const{
+    if (using_bvh){
+        return bvh.collideBoolean(r, d, occluder);
+    }
+    return kdtree.collideBoolean(r, d, occluder);
+}
+
+void Raytracer::collidePacket(const Ray *rays, Collision *c) const{
+    if (using_bvh){
+        for (int i = 0; i < KD_PACKET_SIZE; ++i){
+            bvh.collide(rays[i], c[i]);
+        }
+    }
+    else{
+        kdtree.collidePacket(rays, c);
+    }
+}
+
+void Raytracer::addDirectLighting(const Ray &r, const Collision &closest, const Vec3 &collision_point, CRandomMersenne &twister,
+                                  ShadowCache &shadow_cache, Color &c) const{
+    Shape const *s = closest.shape;
+    if (shadow_cache.occluders.size() != lights.size()){
+        shadow_cache.occluders.assign(lights.size(), NULL);
+    }
+    // Only shade calculation for each source.
+    for (vector<Light>::const_iterator light_iter = lights.begin(); light_iter != lights.end(); ++light_iter){
+        const Light &l = *light_iter;
+        const Shape *&occluder = shadow_cache.occluders[light_iter - lights.begin()];
+        float shade = 0;
+        int num_samples = l.numSamples();
+        for (int i = 0; i < num_samples; ++i){
+            if (!booleanTrace(collision_point, l.samplePoint(i, twister), occluder)){
+                ++shade;
+            }
+        }
+
+        if (shade == 0){
+            continue;
+        }
+        
+        shade /= num_samples;
+
+        Vec3 collision_to_light_direction = l.pos - collision_point;
+        float falloff = min<float>(1, FALLOFF / collision_to_light_direction.magnitude2()) * shade;
+        collision_to_light_direction.normalize();
+                
+        float diffuse = closest.normal.dot(collision_to_light_direction);
+        if (diffuse > 0){
+            c += (s->mat.color * l.color) * (s->mat.k_diffuse * diffuse * falloff);
+        }
+
+        if (false && s->mat.k_specular > 0){
+            Vec3 light_refl_direction = collision_to_light_direction - (closest.normal * 2 * closest.normal.dot(collision_to_light_direction));
+            float specular = pow(light_refl_direction.dot((r.origin - collision_point).asNormal()), s->mat.shininess);
+            c += (s->mat.color * l.color) * (s->mat.k_specular * specular * falloff);
+        }
+    }
 }
 
-Color Raytracer::radianceTrace(const Ray &r) const{
+Color Raytracer::photonRadiance(const Vec3 &collision_point, const Collision &closest) const{
+    Shape const *s = closest.shape;
+    NearestPhotons nearest;
+    // A precomputed estimate replaces the global gather, as long as there's one nearby
+    // on a surface facing the same way.
+    if (using_irradiance){
+        const Photon *irradiance = irradiance_map.nearestFacing(collision_point, closest.normal, nearest);
+        if (irradiance != NULL){
+            return (s->mat.color * irradiance->power()) * s->mat.k_diffuse;
+        }
+    }
+
+    global_map.kNearestNeighbors(collision_point, K_NEAREST_AMT, nearest);
+    if (nearest.size == 0){
+        return Color();
+    }
+
+    Color c_photons_global;
+    for (unsigned int i = 0; i < nearest.size; ++i){
+        const Photon *p = nearest[i];
+        float diffuse = closest.normal.dot(-p->incidentDirection());
+        if (diffuse > 0){
+            c_photons_global += (s->mat.color * p->power()) * (s->mat.k_diffuse * diffuse);
+        }
+    }
+    return c_photons_global / (PI * nearest.maxDistance2());
+}
+
+Color Raytracer::radianceTrace(const Ray &r, CRandomMersenne &twister, ShadowCache &shadow_cache, float &distance) const{
     Collision closest;
-    kdtree.collide(r, closest);
+    collide(r, closest);
 
     if (closest.collided){
+        distance = closest.distance;
         Vec3 collision_point = r.pointAt(closest.distance) + (closest.normal * EPSILON);
 
-        vector<Photon*> photons;
-        global_map.kNearestNeighbors(collision_point, K_NEAREST_AMT, photons);
-        
         Color radiance;
-        for (vector<Photon*>::iterator p_iter = photons.begin(); p_iter != photons.end(); ++p_iter){
-            radiance += (*p_iter)->color * max<float>(closest.normal.dot(-((*p_iter)->incident_direction)), 0);
-        }
-        return radiance / (PI * (photons[0]->point - collision_point).magnitude2());
+        addDirectLighting(r, closest, collision_point, twister, shadow_cache, radiance);
+        return radiance + photonRadiance(collision_point, closest);
     }
     else{
+        distance = numeric_limits<float>::infinity();
         return Color();
     }
 }
 
+Color Raytracer::finalGather(const Vec3 &point, const Vec3 &normal, CRandomMersenne &twister, ShadowCache &shadow_cache) const{
+    Color irradiance;
+    if (irradiance_cache->interpolate(point, normal, irradiance)){
+        return irradiance;
+    }
+
+    // Any two directions perpendicular to the normal and each other.
+    Vec3 x_dir = (fabs(normal.x) > 0.5 ? Vec3(0, 1, 0) : Vec3(1, 0, 0)).cross(normal).asNormal();
+    Vec3 y_dir = normal.cross(x_dir);
+
+    // Cosine-weighted directions, one jittered in each cell of a grid over the unit square, so the
+    // average of the radiance seen is proportional to the irradiance.
+    float inverse_distances = 0;
+    Ray gather_ray;
+    gather_ray.origin = point;
+    for (int i = 0; i < FINAL_GATHER_STRATA; ++i){
+        for (int j = 0; j < FINAL_GATHER_STRATA; ++j){
+            float u = (i + twister.Random()) / FINAL_GATHER_STRATA, v = (j + twister.Random()) / FINAL_GATHER_STRATA;
+            float radius = sqrt(u), angle = 2 * PI * v;
+            gather_ray.direction = x_dir * (radius * cos(angle)) + y_dir * (radius * sin(angle)) + normal * sqrt(1 - u);
+
+            float distance;
+            irradiance += radianceTrace(gather_ray, twister, shadow_cache, distance);
+            inverse_distances += 1 / distance;
+        }
+    }
+    irradiance /= FINAL_GATHER_STRATA * FINAL_GATHER_STRATA;
+
+    // Nothing was hit, so there's nothing nearby to make the irradiance change.
+    float harmonic_mean_distance = inverse_distances > 0 ? FINAL_GATHER_STRATA * FINAL_GATHER_STRATA / inverse_distances :
+                                                           numeric_limits<float>::infinity();
+    irradiance_cache->add(point, normal, irradiance, harmonic_mean_distance);
+    return irradiance;
+}
+
 void Raytracer::photonTrace(const Color &color, const Ray &r, CRandomMersenne &twister, int depth, bool is_caustic, vector<Photon> &global, vector<Photon> &caustics) const{
     if (depth == MAX_REFLECTIONS){
             return;
     }
 
     Collision closest;
-    kdtree.collide(r, closest);
+    collide(r, closest);
 
     if (closest.collided){
         Shape const *s = closest.shape;
@@ -414,9 +879,9 @@ void Raytracer::photonTrace(const Color &color, const Ray &r, CRandomMersenne &t
             if (depth > 0){
                 Photon p;
                 p.point = collision_point;
-                p.incident_direction = r.direction;
-                p.normal = closest.normal;
-                p.color = color;
+                p.setIncidentDirection(r.direction);
+                p.setNormal(closest.normal);
+                p.setPower(color);
                 if (is_caustic){
                     caustics.push_back(p);
                 }
@@ -436,9 +901,9 @@ void Raytracer::photonTrace(const Color &color, const Ray &r, CRandomMersenne &t
             if (depth > 0){
                 Photon p;
                 p.point = collision_point;
-                p.incident_direction = r.direction;
-                p.normal = closest.normal;
-                p.color = color;
+                p.setIncidentDirection(r.direction);
+                p.setNormal(closest.normal);
+                p.setPower(color);
                 if (is_caustic){
                     caustics.push_back(p);
                 }
@@ -450,49 +915,395 @@ void Raytracer::photonTrace(const Color &color, const Ray &r, CRandomMersenne &t
     }
 }
 
-void Raytracer::createPhotonMap(int num_photons, const vector<Light> &lights){
-    CRandomMersenne twister(time(NULL));
-    num_photons /= lights.size();
-    
-    vector<Photon> global, caustics;
-
-    cerr << "Firing " << (num_photons * lights.size()) << " photons... ";
-    cerr.flush();
-    for (vector<Light>::const_iterator l_iter = lights.begin(); l_iter != lights.end(); ++l_iter){
-        Light l = *l_iter;
-        for (int i = 0; i < num_photons; ++i){
-            photonTrace(l.color, 
+void Raytracer::firePhotons(const vector<Light> *lights, const int photons_per_light, const unsigned int begin,
+                            const unsigned int end, const int seed, vector<Photon> *global, vector<Photon> *caustics) const{
+    unsigned int num_photons = photons_per_light * lights->size();
+    for (unsigned int batch = begin; batch < end; ++batch){
+        CRandomMersenne twister(seed + batch);
+        for (unsigned int i = batch * PHOTON_BATCH_SIZE; i < min(num_photons, (batch + 1) * PHOTON_BATCH_SIZE); ++i){
+            const Light &l = (*lights)[i / photons_per_light];
+            photonTrace(l.color,
                         Ray(l.pos, Vec3(twister.Random() - 0.5, twister.Random() - 0.5, twister.Random() - 0.5).asNormal()),
                         twister,
                         0,
                         false,
+                        *global,
+                        *caustics);
+        }
+    }
+}
+
+void Raytracer::fireCausticPhotons(const vector<Light> *lights, const int photons_per_light, const unsigned int begin,
+                                   const unsigned int end, const int seed, vector<Photon> *caustics, float *weight) const{
+    unsigned int num_photons = photons_per_light * lights->size();
+    // Global photons from here would crowd around the specular shapes, so they're thrown away.
+    vector<Photon> global;
+    for (unsigned int batch = begin; batch < end; ++batch){
+        CRandomMersenne twister(seed + batch);
+        for (unsigned int i = batch * PHOTON_BATCH_SIZE; i < min(num_photons, (batch + 1) * PHOTON_BATCH_SIZE); ++i){
+            const ProjectionMap &projection_map = projection_maps[i / photons_per_light];
+            if (projection_map.empty()){
+                continue;
+            }
+            // Firing only into part of the sphere makes each photon that much more likely to
+            // hit a specular shape, so its power shrinks to match.
+            const Light &l = (*lights)[i / photons_per_light];
+            float coverage = projection_map.coverage();
+            unsigned int num_caustics = caustics->size();
+            photonTrace(l.color * coverage,
+                        Ray(l.pos, projection_map.sampleDirection(twister)),
+                        twister,
+                        0,
+                        false,
                         global,
-                        caustics);
+                        *caustics);
+            *weight += coverage * (caustics->size() - num_caustics);
+            global.clear();
         }
     }
-    cerr << "done" << endl;
+}
+
+void Raytracer::shootPhotons(int num_photons, const vector<Light> &lights, const int threads, const int seed,
+                             vector<Photon> &global, vector<Photon> &caustics) const{
+    num_photons /= lights.size();
+
+    // Each thread fires a contiguous range of batches into photon lists of its own, so
+    // nothing is shared while firing. Joining the lists in thread order then gives the same
+    // photons in the same order no matter how many threads there are.
+    unsigned int num_batches = (num_photons * lights.size() + PHOTON_BATCH_SIZE - 1) / PHOTON_BATCH_SIZE;
+    vector<vector<Photon> > thread_global(threads), thread_caustics(threads);
+    boost::thread_group firers;
+    for (int t = 0; t < threads; ++t){
+        firers.create_thread(boost::bind(&Raytracer::firePhotons, this, &lights, num_photons,
+                                         num_batches * t / threads, num_batches * (t + 1) / threads, seed,
+                                         &thread_global[t], &thread_caustics[t]));
+    }
+    firers.join_all();
+    unsigned int num_global = 0, num_caustics = 0;
+    for (int t = 0; t < threads; ++t){
+        num_global += thread_global[t].size();
+        num_caustics += thread_caustics[t].size();
+    }
+    global.reserve(num_global);
+    caustics.reserve(num_caustics);
+    for (int t = 0; t < threads; ++t){
+        global.insert(global.end(), thread_global[t].begin(), thread_global[t].end());
+        caustics.insert(caustics.end(), thread_caustics[t].begin(), thread_caustics[t].end());
+        vector<Photon>().swap(thread_global[t]);
+        vector<Photon>().swap(thread_caustics[t]);
+    }
 
-    Photon *photon_array = new Photon[global.size()];
-    copy(global.begin(), global.end(), photon_array);
     for (unsigned int i = 0; i < global.size(); ++i){
-        photon_array[i].color /= global.size() * GLOBAL_POWER_SCALING;
+        global[i].setPower(global[i].power() / (global.size() * GLOBAL_POWER_SCALING));
+    }
+
+    bool focused = false;
+    for (vector<ProjectionMap>::const_iterator p_iter = projection_maps.begin(); p_iter != projection_maps.end(); ++p_iter){
+        focused = focused || !p_iter->empty();
+    }
+    if (!focused){
+        for (unsigned int i = 0; i < caustics.size(); ++i){
+            caustics[i].setPower(caustics[i].power() / (caustics.size() * CAUSTICS_POWER_SCALING));
+        }
+        return;
+    }
+
+    // Replace the caustic photons with ones fired at the specular shapes, with random number
+    // streams following on from the batches above.
+    vector<float> thread_weight(threads, 0);
+    boost::thread_group caustic_firers;
+    for (int t = 0; t < threads; ++t){
+        caustic_firers.create_thread(boost::bind(&Raytracer::fireCausticPhotons, this, &lights, num_photons,
+                                                 num_batches * t / threads, num_batches * (t + 1) / threads, seed + num_batches,
+                                                 &thread_caustics[t], &thread_weight[t]));
+    }
+    caustic_firers.join_all();
+    vector<Photon>().swap(caustics);
+    num_caustics = 0;
+    float weight = 0;
+    for (int t = 0; t < threads; ++t){
+        num_caustics += thread_caustics[t].size();
+        weight += thread_weight[t];
+    }
+    caustics.reserve(num_caustics);
+    for (int t = 0; t < threads; ++t){
+        caustics.insert(caustics.end(), thread_caustics[t].begin(), thread_caustics[t].end());
+        vector<Photon>().swap(thread_caustics[t]);
     }
-   
-    cerr << "Building global photon map from resulting " << global.size() << " photons... ";
-    cerr.flush();
-    global_map = PhotonMap(photon_array, global.size());
-    cerr << "done" << endl;
 
-    photon_array = new Photon[caustics.size()];
-    copy(caustics.begin(), caustics.end(), photon_array);
+    // Dividing by the total weight rather than the count gives the same power per light that
+    // firing evenly in every direction would have, on average.
     for (unsigned int i = 0; i < caustics.size(); ++i){
-        photon_array[i].color /= caustics.size() * CAUSTICS_POWER_SCALING;
+        caustics[i].setPower(caustics[i].power() / (weight * CAUSTICS_POWER_SCALING));
+    }
+}
+
+void Raytracer::createPhotonMap(int num_photons, const vector<Light> &lights, const vector<Shape*> &shapes,
+                                const RenderOptions &options){
+    int threads = options.threads;
+
+    uint64_t cache_key = 0;
+    string cache_path;
+    if (!options.photon_cache.empty()){
+        cache_key = photonCacheKey(lights, shapes, num_photons);
+        cache_path = photonCachePath(options.photon_cache, cache_key);
+    }
+
+    if (!cache_path.empty() && loadPhotonMaps(cache_path, cache_key, global_map, caustics_map)){
+        cerr << "Loaded photon maps (" << global_map.heapOrder().size() << " global, " << caustics_map.heapOrder().size()
+             << " caustics photons) from " << cache_path << endl;
+    }
+    else{
+        vector<Photon> global, caustics;
+
+        cerr << "Firing " << (num_photons / lights.size() * lights.size()) << " photons (" << threads << " threads)... ";
+        cerr.flush();
+        shootPhotons(num_photons, lights, threads, time(NULL), global, caustics);
+        cerr << "done" << endl;
+
+        cerr << "Building global photon map from resulting " << global.size() << " photons (" << threads << " threads)... ";
+        cerr.flush();
+        global_map = PhotonMap(global, threads);
+        cerr << "done" << endl;
+
+        cerr << "Building caustics photon map from resulting " << caustics.size() << " photons (" << threads << " threads)... ";
+        cerr.flush();
+        caustics_map = PhotonMap(caustics, threads);
+        cerr << "done" << endl;
+
+        if (!cache_path.empty()){
+            if (savePhotonMaps(cache_path, cache_key, global_map, caustics_map)){
+                cerr << "Saved photon maps to " << cache_path << endl;
+            }
+            else{
+                cerr << "Warning: could not write photon map cache " << cache_path << endl;
+            }
+        }
+    }
+
+    using_irradiance = options.precompute_irradiance;
+    if (using_irradiance){
+        cerr << "Precomputing irradiance at every " << IRRADIANCE_SPACING << " global photons... ";
+        cerr.flush();
+        irradiance_map = global_map.irradianceMap(IRRADIANCE_SPACING, K_NEAREST_AMT, threads);
+        cerr << "done" << endl;
+    }
+}
+
+void Raytracer::collectHitPoints(vector<HitPoint> &hit_points) const{
+    // One ray through the middle of each antialiasing sample's grid square.
+    for (int x = 0; x < resx; ++x){
+        for (int y = 0; y < resy; ++y){
+            for (int i = 0; i < aa_samples; ++i){
+                for (int j = 0; j < aa_samples; ++j){
+                    Ray r;
+                    r.origin = origin + (cam_x_vec * (x + (i + 0.5) / aa_samples)) + (cam_y_vec * (y + (j + 0.5) / aa_samples));
+                    r.direction = r.origin - eye;
+                    r.direction.normalize();
+                    collectHitPoints(r, x * resy + y, 1.0 / (aa_samples * aa_samples), 0, hit_points);
+                }
+            }
+        }
+    }
+}
+
+void Raytracer::collectHitPoints(const Ray &r, const unsigned int pixel, const float weight, const int depth,
+                                 vector<HitPoint> &hit_points) const{
+    if (depth == MAX_REFLECTIONS){
+        return;
+    }
+
+    Collision closest;
+    collide(r, closest);
+    if (!closest.collided){
+        return;
+    }
+    // Lights in front of the surface hide it, as in shade().
+    for (vector<Light>::const_iterator l_iter = lights.begin(); l_iter != lights.end(); ++l_iter){
+        float t = l_iter->collide(r);
+        if (t > 0 && t < closest.distance){
+            return;
+        }
+    }
+
+    Shape const *s = closest.shape;
+    Vec3 collision_point = r.pointAt(closest.distance) + (closest.normal * EPSILON);
+
+    HitPoint hit_point;
+    hit_point.point = collision_point;
+    hit_point.normal = closest.normal;
+    hit_point.shape = s;
+    hit_point.pixel = pixel;
+    hit_point.weight = weight;
+    hit_points.push_back(hit_point);
+
+    // Follow the same rays shade() does, weighted the same way.
+    if (s->mat.pct_refl > 0){
+        Ray r_reflected;
+        r_reflected.origin = collision_point;
+        r_reflected.direction = r.direction - (closest.normal * 2 * closest.normal.dot(r.direction));
+        collectHitPoints(r_reflected, pixel, weight * s->mat.pct_refl, depth + 1, hit_points);
+    }
+
+    if (s->mat.pct_refr > 0){
+        Ray r_refracted;
+        r_refracted.origin = collision_point - (closest.normal * EPSILON * 2);
+
+        float n, n1, n2;
+        if (r.inside_shape == NULL){
+            n1 = 1;
+            n2 = s->mat.refr_index;
+            n = n1 / n2;
+            r_refracted.inside_shape = s;
+        }
+        else{
+            n1 = s->mat.refr_index;
+            n2 = 1;
+            n = n1;
+            r_refracted.inside_shape = NULL;
+        }
+
+        float refracted_weight = weight * s->mat.pct_refr;
+        float cos_i = r.direction.dot(closest.normal);
+        float sin_i2 = n * n * (1 - cos_i * cos_i);
+        if (sin_i2 > 1){
+            r_refracted.direction = r.direction - (closest.normal * 2 * closest.normal.dot(r.direction));
+            collectHitPoints(r_refracted, pixel, refracted_weight, depth + 1, hit_points);
+        }
+        else{
+            r_refracted.direction = r.direction * n - closest.normal * (n * cos_i + sqrt(1 - sin_i2));
+
+            float cos_t = r_refracted.direction.dot(closest.normal);
+            float r_par =  (n2 * cos_i - n1 * cos_t) / (n2 * cos_i + n1 * cos_t);
+            float r_perp = (n1 * cos_i - n2 * cos_t) / (n1 * cos_i + n2 * cos_t);
+            float pct_reflected = 0.5 * (r_par * r_par + r_perp * r_perp);
+
+            if (pct_reflected < FRESNEL_REFLECTIVE_MIN){
+                collectHitPoints(r_refracted, pixel, refracted_weight, depth + 1, hit_points);
+            }
+            else{
+                Ray r_reflected;
+                r_reflected.origin = collision_point;
+                r_reflected.direction = r.direction - (closest.normal * 2 * closest.normal.dot(r.direction));
+
+                collectHitPoints(r_refracted, pixel, refracted_weight * (1 - pct_reflected), depth + 1, hit_points);
+                collectHitPoints(r_reflected, pixel, refracted_weight * pct_reflected, depth + 1, hit_points);
+            }
+        }
+    }
+}
+
+// Counts the photons near a hit point and sums the flux they bring, weighted the way shade()
+// weights photons from the global map.
+struct GlobalFluxGatherer{
+    GlobalFluxGatherer(const HitPoint &hit_point) : hit_point(hit_point), count(0) {}
+
+    void operator()(const Photon &p){
+        ++count;
+        float diffuse = hit_point.normal.dot(-p.incidentDirection());
+        if (diffuse > 0){
+            flux += (hit_point.shape->mat.color * p.power()) * (hit_point.shape->mat.k_diffuse * diffuse);
+        }
+    }
+
+    const HitPoint &hit_point;
+    unsigned int count;
+    Color flux;
+};
+
+// The same for photons from the caustics map, whose power is used as is.
+struct CausticFluxGatherer{
+    CausticFluxGatherer() : count(0) {}
+
+    void operator()(const Photon &p){
+        ++count;
+        flux += p.power();
+    }
+
+    unsigned int count;
+    Color flux;
+};
+
+// Fold the given number of new photons and their flux into the given estimate, shrinking its
+// radius so that only PROGRESSIVE_ALPHA of the new photons are kept (Hachisuka et al.).
+inline void updateEstimate(ProgressiveEstimate &estimate, const unsigned int count, const Color &flux){
+    if (count == 0){
+        return;
+    }
+    float photons = estimate.photons + PROGRESSIVE_ALPHA * count;
+    float ratio = photons / (estimate.photons + count);
+    estimate.radius2 *= ratio;
+    estimate.flux = (estimate.flux + flux) * ratio;
+    estimate.photons = photons;
+}
+
+void Raytracer::gatherProgressive(vector<HitPoint> *hit_points, const unsigned int begin, const unsigned int end,
+                                  const PhotonMap *global, const PhotonMap *caustics) const{
+    NearestPhotons nearest;
+    for (unsigned int i = begin; i < end; ++i){
+        HitPoint &hit_point = (*hit_points)[i];
+
+        // Start out gathering as far as the usual number of nearest photons reach, so the first
+        // pass matches a photon map of the same size.
+        if (hit_point.global.radius2 == 0){
+            global->kNearestNeighbors(hit_point.point, K_NEAREST_AMT, nearest);
+            if (nearest.size > 0){
+                hit_point.global.radius2 = nearest.maxDistance2();
+            }
+        }
+        if (hit_point.caustic.radius2 == 0){
+            caustics->kNearestNeighbors(hit_point.point, K_NEAREST_AMT, nearest);
+            if (nearest.size > 0){
+                hit_point.caustic.radius2 = nearest.maxDistance2();
+            }
+        }
+
+        GlobalFluxGatherer global_gatherer(hit_point);
+        global->photonsWithin(hit_point.point, hit_point.global.radius2, global_gatherer);
+        updateEstimate(hit_point.global, global_gatherer.count, global_gatherer.flux);
+
+        CausticFluxGatherer caustic_gatherer;
+        caustics->photonsWithin(hit_point.point, hit_point.caustic.radius2, caustic_gatherer);
+        updateEstimate(hit_point.caustic, caustic_gatherer.count, caustic_gatherer.flux);
+    }
+}
+
+void Raytracer::progressivePass(vector<HitPoint> &hit_points, const int pass, const int threads, const int seed) const{
+    if (progressive_photons == 0){
+        return;
+    }
+
+    // Start each pass's batches where the last pass's left off, so every pass gets random
+    // number streams of its own. Firing caustic photons separately takes twice as many.
+    int num_batches = 2 * ((progressive_photons + PHOTON_BATCH_SIZE - 1) / PHOTON_BATCH_SIZE);
+    vector<Photon> global, caustics;
+    shootPhotons(progressive_photons, lights, threads, seed + pass * num_batches, global, caustics);
+    PhotonMap pass_global_map(global, threads), pass_caustics_map(caustics, threads);
+    // The maps have copies of their own.
+    vector<Photon>().swap(global);
+    vector<Photon>().swap(caustics);
+
+    // Every thread updates a separate range of the hit points.
+    boost::thread_group gatherers;
+    for (int t = 0; t < threads; ++t){
+        gatherers.create_thread(boost::bind(&Raytracer::gatherProgressive, this, &hit_points, hit_points.size() * t / threads,
+                                            hit_points.size() * (t + 1) / threads, &pass_global_map, &pass_caustics_map));
+    }
+    gatherers.join_all();
+}
+
+void Raytracer::addProgressiveRadiance(const vector<HitPoint> &hit_points, const int passes, vector<Color> &image) const{
+    for (vector<HitPoint>::const_iterator h_iter = hit_points.begin(); h_iter != hit_points.end(); ++h_iter){
+        Color radiance;
+        if (h_iter->global.radius2 > 0){
+            radiance += h_iter->global.flux / (PI * h_iter->global.radius2);
+        }
+        if (h_iter->caustic.radius2 > 0){
+            radiance += h_iter->caustic.flux / (PI * h_iter->caustic.radius2);
+        }
+        // Each pass's photons carry as much power as a whole photon map, so average over passes.
+        image[h_iter->pixel] += radiance * (h_iter->weight / passes);
     }
-   
-    cerr << "Building caustics photon map from resulting " << caustics.size() << " photons... ";
-    cerr.flush();
-    caustics_map = PhotonMap(photon_array, caustics.size());
-    cerr << "done" << endl;
 }
 
 int Raytracer::getX() const{
@@ -3,30 +3,211 @@
 
 #include "constants.h"
 
+#include <string>
+#include <utility>
 #include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/serialization/shared_ptr.hpp>
 
 #include "vec3.h"
 #include "ray.h"
 #include "shapes.h"
 #include "light.h"
 #include "kdtree.h"
+#include "bvh.h"
 #include "photonmap.h"
+#include "irradiancecache.h"
+#include "projectionmap.h"
 #include "randomc/randomc.h"
 
 const int K_NEAREST_AMT = 100;
 
+// Photons are fired in batches of this many, each with its own random number stream, so
+// the photons fired don't depend on how the batches are split up among threads.
+const int PHOTON_BATCH_SIZE = 4096;
+
+// When irradiance is precomputed, it's estimated at one in this many global photons.
+const unsigned int IRRADIANCE_SPACING = 4;
+
+// A final gather traces one ray in each cell of a grid this many cells on a side.
+const int FINAL_GATHER_STRATA = 8;
+
+// The fraction of the photons found at a hit point that progressive photon mapping keeps
+// in its count after each pass. Lower values shrink the gather radius faster.
+const float PROGRESSIVE_ALPHA = 0.7;
+
+// Adaptive antialiasing first traces a grid this many samples on a side in each pixel, and only
+// traces the full grid if they hit different shapes or their colors differ by more than this
+// fraction of their sum in any of red, green or blue (Mitchell's thresholds).
+// ADAPTIVE_AA_SIDE squared must be at most KD_PACKET_SIZE.
+const int ADAPTIVE_AA_SIDE = 2;
+const float ADAPTIVE_AA_CONTRAST[3] = {0.4, 0.3, 0.6};
+
+// Reflected and refracted rays that could change a pixel's color by less than this aren't
+// traced. It's well under one step of an 8-bit channel, since a glass surface can cut off
+// hundreds of them whose colors would have added up.
+const float RAY_TREE_MIN_CONTRIBUTION = 1.0 / 4096;
+
+// The most rays a single surface can spawn: a reflection, and a refraction with its own
+// Fresnel reflection.
+const int MAX_RAY_BRANCHES = 3;
+
+// Settings given on the command line rather than in the input file.
+struct RenderOptions{
+    RenderOptions() : threads(DEFAULT_THREADS), kd_bins(0), use_bvh(false), precompute_irradiance(false), final_gather(false),
+                      progressive_passes(0), adaptive_aa(false),
+                      russian_roulette(false), wavefront(false) {}
+
+    // How many threads to preprocess and render with.
+    uint8_t threads;
+
+    // Bins per axis for a binned kd-tree build, or 0 to evaluate every split exactly.
+    int kd_bins;
+
+    // Whether to find collisions with a BVH instead of a kd-tree.
+    bool use_bvh;
+
+    // Whether to precompute irradiance from the global photon map, so shading looks it up
+    // instead of gathering photons.
+    bool precompute_irradiance;
+
+    // Whether to light diffuse surfaces by final gathering from the photon maps, through an
+    // irradiance cache, instead of by gathering photons directly.
+    bool final_gather;
+
+    // How many passes of progressive photon mapping to run, each firing the scene's number of
+    // photons, or 0 to build photon maps up front as usual.
+    int progressive_passes;
+
+    // The directory to cache photon maps in, keyed by the scene, or empty not to cache them.
+    string photon_cache;
+
+    // Whether to trace only a few samples in pixels where they agree, rather than every
+    // antialiasing sample everywhere.
+    bool adaptive_aa;
+
+    // Whether to trace some of the rays too faint to be worth tracing, weighted up to make up
+    // for the rest, rather than none of them.
+    bool russian_roulette;
+
+    // Whether to render tiles a bounce at a time instead of a pixel at a time.
+    bool wavefront;
+};
+
+// Per-thread memory of the shape that last blocked a shadow ray towards each light. Shadow
+// rays towards the same light from nearby points tend to be blocked by the same shape, so
+// that shape is tested before the rest of the scene is searched.
+struct ShadowCache{
+    // Indexed like Raytracer::lights. NULL if nothing has blocked that light yet.
+    vector<const Shape*> occluders;
+};
+
+// A ray spawned by reflection or refraction at a surface, and the fraction of the surface's
+// color that the ray's color makes up.
+struct RayBranch{
+    Ray ray;
+    float weight;
+};
+
+// A ray waiting to be traced in wavefront rendering, and the node of the ray tree its color
+// goes in.
+struct WavefrontRay{
+    Ray ray;
+    unsigned int node;
+    int depth;
+    // How much the ray's color could change its pixel's color, as in shade().
+    float contribution;
+    // Orders rays by direction octant and then by origin along a Z-order curve, so that rays
+    // next to each other in a queue tend to visit the same parts of the scene.
+    uint64_t key;
+
+    inline bool operator<(const WavefrontRay &r) const { return key < r.key; }
+};
+
+// A surface (or light, or the background) in a ray tree traced in wavefront rendering. Its
+// color starts out as shadeLocally() gives it, and gets its branches' colors added once every
+// wave has been traced.
+struct WavefrontNode{
+    Color color;
+    bool clamped;
+    // Whether the branches went past MAX_REFLECTIONS and take the background color instead.
+    bool cut;
+    int num_branches;
+    // The nodes of the branches, or WAVEFRONT_PRUNED for those not traced, and their weights.
+    unsigned int branches[MAX_RAY_BRANCHES];
+    float weights[MAX_RAY_BRANCHES];
+};
+
+const unsigned int WAVEFRONT_PRUNED = (unsigned int) -1;
+
+// Per-thread buffers for wavefront rendering, kept from tile to tile so that they're only
+// allocated while they grow.
+struct WavefrontState{
+    vector<WavefrontRay> rays, next_rays;
+    vector<Collision> collisions;
+    vector<WavefrontNode> nodes;
+};
+
+// Photon statistics kept at a hit point across the passes of progressive photon mapping.
+struct ProgressiveEstimate{
+    ProgressiveEstimate() : radius2(0), photons(0) {}
+
+    // The squared radius photons are gathered within, or 0 before the first pass. It shrinks
+    // with every pass that finds photons.
+    float radius2;
+
+    // How many photons the estimate is based on.
+    float photons;
+
+    // The flux gathered within the radius so far, adjusted as the radius shrinks.
+    Color flux;
+};
+
+// A point on a surface seen from a pixel, where progressive photon mapping gathers photons.
+struct HitPoint{
+    Vec3 point, normal;
+    const Shape *shape;
+
+    // The pixel (x * resy + y) the point was seen from, and how much of the light reflected
+    // here reaches it.
+    unsigned int pixel;
+    float weight;
+
+    ProgressiveEstimate global, caustic;
+};
+
 class Raytracer{
  public:
     // Required by the serialization library and input processing.
     Raytracer() {}
 
     // Instantiate a raytracer with all the necessary information.
-    Raytracer(const Vec3&, const Vec3&, float, int, int, float, int, int, const Color&, const Color&, const vector<Light>&, const vector<Shape*>&);
+    Raytracer(const Vec3&, const Vec3&, float, int, int, float, int, int, const Color&, const Color&, const vector<Light>&, const vector<Shape*>&,
+              const RenderOptions&);
     
     // Compute the color at the given pixel location (bottom-left origin). This is done
     // with one or more calls to colorTrace(Ray, int), depending on how many samples
-    // are being use for anti-aliasing (if any).
-    Color colorTrace(int, int, CRandomMersenne&) const;
+    // are being use for anti-aliasing (if any) and, with adaptive antialiasing, on
+    // whether the pixel needs them.
+    Color colorTrace(int, int, CRandomMersenne&, ShadowCache&) const;
+
+    // Compute the colors of the given number of pixels (x, y) into the given array, the same
+    // as colorTrace() but tracing every pixel's rays together a bounce at a time: every camera
+    // ray, then all the rays they spawn, sorted to be coherent, and so on. Every antialiasing
+    // sample is traced, adaptive or not.
+    void wavefrontTrace(const pair<int, int>*, const int, CRandomMersenne&, ShadowCache&, WavefrontState&, Color*) const;
+
+    // Find every point where photons are gathered for any pixel, for progressive photon mapping.
+    void collectHitPoints(vector<HitPoint>&) const;
+
+    // Run the given pass (counting from 0) of progressive photon mapping over the given hit
+    // points: fire the scene's number of photons from the given seed with the given number of
+    // threads, gather them at every hit point, and discard them.
+    void progressivePass(vector<HitPoint>&, const int, const int, const int) const;
+
+    // Add the photon mapped light at each of the given hit points after the given number of
+    // passes to its pixel in the given image (indexed like HitPoint::pixel).
+    void addProgressiveRadiance(const vector<HitPoint>&, const int, vector<Color>&) const;
 
     // Get the X or Y resolution or the antialias samples of the image.
     int getX() const;
@@ -34,26 +215,97 @@ class Raytracer{
     int getAASamples() const;
 
  private:
-    // Compute the color for the given ray, returning a default color if the depth
-    // has gone too far.
-    Color colorTrace(const Ray&, CRandomMersenne&, int depth = 0) const;
+    // Compute the color for the given ray.
+    Color colorTrace(const Ray&, CRandomMersenne&, ShadowCache&) const;
+
+    // The camera ray through the given point of the pixel grid.
+    Ray pixelRay(const float, const float) const;
+
+    // Collide and shade up to KD_PACKET_SIZE camera rays, as a packet if there are that many,
+    // storing each one's color and the shape it hit (NULL if none).
+    void traceSamples(const Ray*, const int, CRandomMersenne&, ShadowCache&, Color*, Shape const**) const;
+
+    // Add a hit point for wherever the given ray, seen from the given pixel with the given
+    // weight, gathers photons, following reflections and refractions like shade().
+    void collectHitPoints(const Ray&, const unsigned int, const float, const int, vector<HitPoint>&) const;
+
+    // Gather the given photon maps at the hit points in the given range [begin, end).
+    void gatherProgressive(vector<HitPoint>*, const unsigned int, const unsigned int, const PhotonMap*, const PhotonMap*) const;
+
+    // Compute the color for the given ray that has already been collided with the scene,
+    // following its tree of reflected and refracted rays up to MAX_REFLECTIONS deep.
+    Color shade(const Ray&, const Collision&, CRandomMersenne&, ShadowCache&) const;
+
+    // Compute the color the given collision gives without any reflected or refracted rays, and
+    // store the rays it spawns in the given array (of at least MAX_RAY_BRANCHES) and their
+    // number in the given int. Return whether the color, once the branches' colors are added,
+    // is to be clamped, which it is for surfaces but not for lights or the background.
+    bool shadeLocally(const Ray&, const Collision&, CRandomMersenne&, ShadowCache&, Color&, RayBranch*, int&) const;
 
     // Return true if there are any objects between the two given points, false otherwise.
-    bool booleanTrace(const Vec3&, const Vec3&) const;
+    // The given shape (if any) is tested first, and is replaced by whatever shape is found
+    // to be in the way.
+    bool booleanTrace(const Vec3&, const Vec3&, const Shape*&) const;
+
+    // Collide the ray with whichever of the kd-tree or BVH is in use.
+    void collide(const Ray&, Collision&) const;
 
-    // Get the radiance of the nearest object from the photon map.
-    Color radianceTrace(const Ray&) const;
+    // Return true if the ray hits anything within the given distance, using whichever
+    // of the kd-tree or BVH is in use, and set the given shape to the one that was hit.
+    bool collideBoolean(const Ray&, const float, const Shape*&) const;
+
+    // Collide KD_PACKET_SIZE rays at once. Only the kd-tree traces them as a packet.
+    void collidePacket(const Ray*, Collision*) const;
+
+    // Add the light reaching the given collision straight from each light source, given the ray
+    // that collided and the point to trace shadow rays from, to the given color.
+    void addDirectLighting(const Ray&, const Collision&, const Vec3&, CRandomMersenne&, ShadowCache&, Color&) const;
+
+    // Get the light reflected at the given point of the given collision from the global photon map.
+    Color photonRadiance(const Vec3&, const Collision&) const;
+
+    // Get the radiance leaving the nearest object towards the ray's origin, from direct light and
+    // the global photon map, and store how far away it is (infinity if nothing was hit).
+    Color radianceTrace(const Ray&, CRandomMersenne&, ShadowCache&, float&) const;
+
+    // Get the irradiance at the given point on a surface with the given normal from the
+    // irradiance cache, gathering it from the surroundings if the cache has nothing nearby.
+    Color finalGather(const Vec3&, const Vec3&, CRandomMersenne&, ShadowCache&) const;
 
     // Trace the photon given by the Ray and the Color, putting entries into the map as appropriate.
     void photonTrace(const Color&, const Ray&, CRandomMersenne&, int, bool, vector<Photon>&, vector<Photon>&) const;
 
-    // Initialize the photon map.
-    void createPhotonMap(int, const vector<Light>&);
+    // Fire the photons in the given range [begin, end) of batches, given how many photons each
+    // light gets and the seed of the first batch, into the given global and caustic photons.
+    void firePhotons(const vector<Light>*, const int, const unsigned int, const unsigned int, const int,
+                     vector<Photon>*, vector<Photon>*) const;
+
+    // Fire photons the same way, but only at the specular shapes each light's projection map
+    // marks, keeping only the caustic photons. Each is weighted by its light's coverage, and the
+    // total weight of the kept photons is added to the given float.
+    void fireCausticPhotons(const vector<Light>*, const int, const unsigned int, const unsigned int, const int,
+                            vector<Photon>*, float*) const;
+
+    // Fire the given number of photons, split evenly among the lights, from the given seed
+    // with the given number of threads. If any light has specular shapes in view, as many
+    // again are fired at them for the caustic photons. Their power is scaled for a photon map
+    // of each list.
+    void shootPhotons(int, const vector<Light>&, const int, const int, vector<Photon>&, vector<Photon>&) const;
+
+    // Initialize the photon maps for the given lights and shapes, from the cache if the options
+    // give one and it has them, and the irradiance map if the options ask for it.
+    void createPhotonMap(int, const vector<Light>&, const vector<Shape*>&, const RenderOptions&);
 
     // Divide the pixel into a square grid with aa_samples spaces on a side. The number of
     // rays used grows quadratically with this value.
     int aa_samples;
 
+    // Whether pixels whose first few samples agree skip the rest of the grid.
+    bool adaptive_aa;
+
+    // Whether rays too faint to trace are sometimes traced anyway (see RenderOptions).
+    bool russian_roulette;
+
     // The resolution of the output image.
     int resx, resy;
 
@@ -76,7 +328,13 @@ class Raytracer{
 
     // The kd-tree that keeps track of all objects that exist in the scene and allows very
     // fast access to them.
-    KDNode kdtree;
+    KDTree kdtree;
+
+    // The alternative to the kd-tree, selected at render time. Only one of them is ever built.
+    BVH bvh;
+
+    // Whether the BVH is used instead of the kd-tree.
+    bool using_bvh;
 
     // Whether or not we are using the photon map for this ray trace.
     bool using_photons;
@@ -87,6 +345,23 @@ class Raytracer{
     // The caustics photon map.
     PhotonMap caustics_map;
 
+    // Whether irradiance from the global photon map was precomputed into irradiance_map.
+    bool using_irradiance;
+
+    // Irradiance precomputed at some of the global photons.
+    PhotonMap irradiance_map;
+
+    // How many photons each pass of progressive photon mapping fires, or 0 if photon maps are
+    // built up front instead.
+    int progressive_photons;
+
+    // Where each light can fire caustic photons, in the same order as the lights. Only
+    // needed while firing photons, so never sent to clients.
+    vector<ProjectionMap> projection_maps;
+
+    // Final gather results, shared by every thread. NULL unless final gathering.
+    boost::shared_ptr<IrradianceCache> irradiance_cache;
+
     // All the lights that have been set for the scene.
     vector<Light> lights;
 
@@ -95,6 +370,8 @@ class Raytracer{
     template<class Archive>
     void serialize(Archive &ar, const unsigned int version){
         ar & aa_samples;
+        ar & adaptive_aa;
+        ar & russian_roulette;
         ar & resx;
         ar & resy;
         ar & eye;
@@ -104,9 +381,15 @@ class Raytracer{
         ar & bkrd;
         ar & ambient;
         ar & kdtree;
+        ar & bvh;
+        ar & using_bvh;
         ar & using_photons;
         ar & global_map;
         ar & caustics_map;
+        ar & progressive_photons;
+        ar & using_irradiance;
+        ar & irradiance_map;
+        ar & irradiance_cache;
         ar & lights;
     }
 };
@@ -58,6 +58,9 @@ class Sphere : public Shape{
     // The radius of this sphere.
     float rad;
 
+    // The kd-tree copies the geometry into its leaves to intersect many spheres at once.
+    friend class KDTree;
+
     friend class boost::serialization::access;
     
     template<class Archive>
@@ -84,6 +87,9 @@ class RectPrism : public Shape{
 
     // The two corners defining this prism. low_corner <= high_corner.
     Vec3 low_corner, high_corner;
+
+    // The kd-tree copies the geometry into its leaves to intersect many prisms at once.
+    friend class KDTree;
     
     friend class boost::serialization::access;
     